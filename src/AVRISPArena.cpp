@@ -0,0 +1,46 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Buffer arena for the page, body and reply buffers.
+*/
+#include "AVRISPArena.h"
+#include <stdlib.h>
+
+// keep every region word aligned
+#define ARENA_ALIGN(n) (((n) + 3) & ~3)
+
+AVRISPArena::AVRISPArena(size_t page_size, size_t body_size, size_t reply_size, size_t reply_headroom):
+_block(nullptr),
+_page(nullptr),
+_body(nullptr),
+_reply(nullptr),
+_pageSize(0),
+_bodySize(0),
+_replySize(0),
+_replyHeadroom(0),
+_pageHigh(0),
+_bodyHigh(0),
+_replyHigh(0),
+_overflows(0)
+{
+    size_t page = ARENA_ALIGN(page_size);
+    size_t body = ARENA_ALIGN(body_size);
+    size_t reply = ARENA_ALIGN(reply_size);
+    size_t headroom = ARENA_ALIGN(reply_headroom);
+    _block = (uint8_t*) malloc(page + body + headroom + reply);
+    if (!_block) {
+        return;
+    }
+    _page = _block;
+    _body = _page + page;
+    _reply = _body + body + headroom;
+    _pageSize = page_size;
+    _bodySize = body_size;
+    _replySize = reply_size;
+    _replyHeadroom = headroom;
+}
+
+AVRISPArena::~AVRISPArena() {
+    free(_block);
+}
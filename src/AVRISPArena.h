@@ -0,0 +1,68 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Buffer arena: the page buffer, the request body buffer and the reply buffer
+are carved out of one block allocated at construction, so serving requests
+never touches the heap. High water marks show how much of each region was
+actually needed. The reply region is preceded by headroom, so a response
+header can be put right in front of the reply and both sent in one write.
+*/
+
+#ifndef AVRISPARENA_H
+#define AVRISPARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class AVRISPArena
+{
+public:
+    AVRISPArena(size_t page_size, size_t body_size, size_t reply_size, size_t reply_headroom = 0);
+    ~AVRISPArena();
+
+    // false if the block could not be allocated, all sizes are 0 then
+    bool ok() const { return _block != nullptr; }
+
+    uint8_t* page() const { return _page; }
+    uint8_t* body() const { return _body; }
+    uint8_t* reply() const { return _reply; }
+
+    size_t pageSize() const { return _pageSize; }
+    size_t bodySize() const { return _bodySize; }
+    size_t replySize() const { return _replySize; }
+    size_t replyHeadroom() const { return _replyHeadroom; }
+    size_t totalSize() const { return _pageSize + _bodySize + _replyHeadroom + _replySize; }
+
+    // record how much of a region a request used
+    void usePage(size_t n) { if (n > _pageHigh) _pageHigh = n; }
+    void useBody(size_t n) { if (n > _bodyHigh) _bodyHigh = n; }
+    void useReply(size_t n) { if (n > _replyHigh) _replyHigh = n; }
+
+    size_t pageHighWater() const { return _pageHigh; }
+    size_t bodyHighWater() const { return _bodyHigh; }
+    size_t replyHighWater() const { return _replyHigh; }
+
+    // requests that did not fit their region
+    uint32_t overflows() const { return _overflows; }
+    void overflow() { _overflows++; }
+
+protected:
+    AVRISPArena(const AVRISPArena&);
+    AVRISPArena& operator=(const AVRISPArena&);
+
+    uint8_t* _block;
+    uint8_t* _page;
+    uint8_t* _body;
+    uint8_t* _reply;
+    size_t _pageSize;
+    size_t _bodySize;
+    size_t _replySize;
+    size_t _replyHeadroom;
+    size_t _pageHigh;
+    size_t _bodyHigh;
+    size_t _replyHigh;
+    uint32_t _overflows;
+};
+
+#endif //AVRISPARENA_H
@@ -0,0 +1,68 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+AVR parts by signature, sizes and write times from the datasheets.
+*/
+#include "AVRISPDevices.h"
+#include <string.h>
+
+#if defined(ARDUINO)
+#include <pgmspace.h>
+#else
+#define PROGMEM
+#define memcpy_P memcpy
+#endif
+
+#define RB AVRISP_DEVICE_RDYBSY
+
+static const AVRISP_device_t devices[] PROGMEM = {
+    // signature         flags flash  page eeprom eepage flash eeprom erase name
+    { {0x1e, 0x95, 0x0f}, RB, 32768,  128, 1024, 4, 4500, 3600, 9000, "ATmega328P" },
+    { {0x1e, 0x95, 0x14}, RB, 32768,  128, 1024, 4, 4500, 3600, 9000, "ATmega328" },
+    { {0x1e, 0x95, 0x16}, RB, 32768,  128, 1024, 4, 4500, 3600, 9000, "ATmega328PB" },
+    { {0x1e, 0x94, 0x0b}, RB, 16384,  128,  512, 4, 4500, 3600, 9000, "ATmega168PA" },
+    { {0x1e, 0x94, 0x06}, RB, 16384,  128,  512, 4, 4500, 3600, 9000, "ATmega168" },
+    { {0x1e, 0x93, 0x0f}, RB,  8192,   64,  512, 4, 4500, 3600, 9000, "ATmega88P" },
+    { {0x1e, 0x93, 0x0a}, RB,  8192,   64,  512, 4, 4500, 3600, 9000, "ATmega88" },
+    { {0x1e, 0x92, 0x0a}, RB,  4096,   64,  256, 4, 4500, 3600, 9000, "ATmega48P" },
+    { {0x1e, 0x92, 0x05}, RB,  4096,   64,  256, 4, 4500, 3600, 9000, "ATmega48" },
+    // no Poll RDY/BSY and no EEPROM page instructions in serial mode, data polling
+    { {0x1e, 0x93, 0x07}, 0,   8192,   64,  512, 0, 4500, 9000, 9000, "ATmega8" },
+    { {0x1e, 0x94, 0x03}, 0,  16384,  128,  512, 0, 4500, 9000, 9000, "ATmega16" },
+    { {0x1e, 0x95, 0x02}, 0,  32768,  128, 1024, 0, 4500, 9000, 9000, "ATmega32" },
+    { {0x1e, 0x95, 0x87}, RB, 32768,  128, 1024, 4, 4500, 9000, 9000, "ATmega32U4" },
+    { {0x1e, 0x96, 0x0a}, RB, 65536,  256, 2048, 8, 4500, 9000, 9000, "ATmega644P" },
+    { {0x1e, 0x97, 0x05}, RB, 131072, 256, 4096, 8, 4500, 9000, 9000, "ATmega1284P" },
+    { {0x1e, 0x97, 0x03}, RB, 131072, 256, 4096, 8, 4500, 9000, 9000, "ATmega1280" },
+    { {0x1e, 0x98, 0x01}, RB, 262144, 256, 4096, 8, 4500, 9000, 9000, "ATmega2560" },
+    { {0x1e, 0x90, 0x07}, RB,  1024,   32,   64, 4, 4500, 4000, 4000, "ATtiny13A" },
+    { {0x1e, 0x91, 0x08}, RB,  2048,   32,  128, 4, 4500, 4000, 9000, "ATtiny25" },
+    { {0x1e, 0x92, 0x06}, RB,  4096,   64,  256, 4, 4500, 4000, 9000, "ATtiny45" },
+    { {0x1e, 0x93, 0x0b}, RB,  8192,   64,  512, 4, 4500, 4000, 9000, "ATtiny85" },
+    { {0x1e, 0x91, 0x0b}, RB,  2048,   32,  128, 4, 4500, 4000, 9000, "ATtiny24" },
+    { {0x1e, 0x92, 0x07}, RB,  4096,   64,  256, 4, 4500, 4000, 9000, "ATtiny44" },
+    { {0x1e, 0x93, 0x0c}, RB,  8192,   64,  512, 4, 4500, 4000, 9000, "ATtiny84" },
+    { {0x1e, 0x91, 0x0a}, RB,  2048,   32,  128, 4, 4500, 4000, 9000, "ATtiny2313" },
+    { {0x1e, 0x92, 0x0d}, RB,  4096,   64,  256, 4, 4500, 4000, 9000, "ATtiny4313" },
+    { {0x1e, 0x91, 0x09}, RB,  2048,   32,  128, 0, 4500, 9000, 9000, "ATtiny26" },
+};
+
+size_t AVRISPDevices::count() {
+    return sizeof(devices) / sizeof(devices[0]);
+}
+
+void AVRISPDevices::get(size_t index, AVRISP_device_t& device) {
+    memcpy_P(&device, &devices[index], sizeof(device));
+}
+
+bool AVRISPDevices::find(uint32_t signature, AVRISP_device_t& device) {
+    for (size_t i = 0; i < count(); i++) {
+        get(i, device);
+        uint32_t s = ((uint32_t)device.signature[0] << 16) | (device.signature[1] << 8) | device.signature[2];
+        if (s == signature) {
+            return true;
+        }
+    }
+    return false;
+}
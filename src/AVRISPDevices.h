@@ -0,0 +1,44 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Table of AVR parts, keyed by signature. When programming mode is entered the
+engine reads the signature and takes the memory sizes, page sizes and write
+times from here, so the host no longer has to guess them in SET_DEVICE. The
+table lives in flash (PROGMEM) on the ESP8266.
+*/
+
+#ifndef AVRISPDEVICES_H
+#define AVRISPDEVICES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// the part answers the 0xF0 poll RDY/BSY instruction
+#define AVRISP_DEVICE_RDYBSY 0x01
+
+typedef struct {
+    uint8_t signature[3];
+    uint8_t flags;
+    uint32_t flashsize;         // bytes
+    uint16_t pagesize;          // flash page, bytes
+    uint16_t eepromsize;        // bytes
+    uint8_t eeprompagesize;     // 0 if the EEPROM is written byte by byte
+    uint16_t twd_flash;         // datasheet write cycles, us
+    uint16_t twd_eeprom;
+    uint16_t twd_erase;
+    char name[12];
+} AVRISP_device_t;
+
+class AVRISPDevices
+{
+public:
+    // copy the entry of signature (as 0x1e950f) into device, false if unknown
+    static bool find(uint32_t signature, AVRISP_device_t& device);
+
+    // all entries, for listing
+    static size_t count();
+    static void get(size_t index, AVRISP_device_t& device);
+};
+
+#endif //AVRISPDEVICES_H
@@ -0,0 +1,1225 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Original version:
+	AVR In-System Programming over WiFi for ESP8266
+	Copyright (c) Kiril Zyapkov <kiril@robotev.com>
+
+    ArduinoISP version 04m3
+    Copyright (c) 2008-2011 Randall Bohn
+    If you require a license, see
+        http://www.opensource.org/licenses/bsd-license.php
+*/
+#include "AVRISPEngine.h"
+#include <string.h>
+
+#include "httpcommand.h"
+
+// #define AVRISP_DEBUG(fmt, ...)     os_printf("[AVRP] " fmt "\r\n", ##__VA_ARGS__ )
+#define AVRISP_DEBUG(...)
+
+#define AVRISP_HWVER 2
+#define AVRISP_SWMAJ 1
+#define AVRISP_SWMIN 18
+// worst case write cycles in ms, the timeout when polling a part that is
+// not in the device table
+#define AVRISP_PTIME 10
+#define AVRISP_EETIME 45
+#define AVRISP_ERASETIME 55
+
+#define EECHUNK (32)
+
+#define beget16(addr) (*addr * 256 + *(addr+1))
+
+// Parm_STK_SCK_DURATION counts 8 periods of the STK500 7.3728 MHz crystal
+#define AVRISP_SCK_DURATION_HZ (7372800UL / 8)
+
+// SCK tried by the calibration above the set frequency, slowest first
+static const uint32_t sck_steps[] = { 500000, 1000000, 2000000, 4000000, 8000000 };
+
+AVRISPEngine::AVRISPEngine(AVRISPSpi& spi, AVRISPResetPin& reset, AVRISPClock& clock, AVRISPArena& arena, uint32_t spi_freq):
+_spi(spi),
+_reset(reset),
+_clock(clock),
+_arena(arena),
+_in(nullptr),
+_select(nullptr),
+buff(arena.page()),
+_burstLen(0),
+_replyLen(0),
+_spi_freq(spi_freq),
+_reset_state(false),
+_sck(spi_freq),
+_sckRequested(0),
+_autoSck(AVRISP_AUTO_SCK),
+_sckNext(0),
+here(0),
+_extAddr(-1),
+_hostExtAddr(0),
+_deviceKnown(false),
+_twdFlash(AVRISP_PTIME * 1000UL),
+_twdEeprom(AVRISP_EETIME * 1000UL),
+_twdErase(AVRISP_ERASETIME * 1000UL),
+_pollMode(AVRISP_POLL_RDYBSY),
+_pollModeSet(AVRISP_POLL_RDYBSY),
+_pollAddr(-1),
+_pollValue(0xFF),
+_incremental(false),
+_erased(false),
+_running(0),
+_runningSince(0),
+_verify(false),
+_verifyAddr(-1),
+_verifyLen(0),
+_verifyCrc(0)
+{
+    memset(&param, 0, sizeof(param));
+    // a location being written reads as 0xFF until SET_DEVICE says otherwise
+    param.flashpoll = 0xFF;
+    param.eeprompoll = 0xFFFF;
+    memset(&_flashTime, 0, sizeof(_flashTime));
+    memset(&_eepromTime, 0, sizeof(_eepromTime));
+    memset(&_eraseTime, 0, sizeof(_eraseTime));
+    memset(&_pages, 0, sizeof(_pages));
+    memset(&_verified, 0, sizeof(_verified));
+    memset(&_device, 0, sizeof(_device));
+    clearStats();
+    clearSckProfiles();
+}
+
+void AVRISPEngine::clearSckProfiles() {
+    memset(_sckProfiles, 0, sizeof(_sckProfiles));
+}
+
+void AVRISPEngine::setSpiFrequency(uint32_t freq) {
+    _spi_freq = freq;
+    if (pmode) {
+        _sck = freq;
+        _spi.setFrequency(freq);
+    }
+}
+
+void AVRISPEngine::setReset(bool rst) {
+    _reset_state = rst;
+    _reset.setReset(_reset_state);
+}
+
+void AVRISPEngine::run(AVRISPTransport& in) {
+    while (in.available()) {
+        command(in);
+    }
+    _arena.useReply(_replyLen);
+}
+
+void AVRISPEngine::command(AVRISPTransport& in) {
+    uint32_t started = _clock.micros();
+    _in = &in;
+    avrisp();
+    _in = nullptr;
+    _stats.command.add(_clock.micros() - started);
+}
+
+uint8_t AVRISPEngine::writeFlash(uint32_t addr, int length) {
+    here = addr / 2;
+    _arena.usePage(length);
+    return write_flash_pages(length);
+}
+
+uint8_t AVRISPEngine::getch() {
+    // a truncated command reads as 0
+    int b = _in ? _in->read() : -1;
+    if (b < 0) {
+        return 0;
+    }
+    // AVRISP_DEBUG("< %02x", b);
+    return b;
+}
+
+bool AVRISPEngine::fill(int n) {
+    // AVRISP_DEBUG("fill(%u)", n);
+    if (n > (int)_arena.pageSize()) {
+        // does not fit the page buffer, consume and drop it
+        _arena.overflow();
+        skip(n);
+        return false;
+    }
+    for (int x = 0; x < n; x++) {
+        buff[x] = getch();
+    }
+    _arena.usePage(n);
+    return true;
+}
+
+void AVRISPEngine::skip(int n) {
+    // data bytes of a rejected command, they must not run as commands
+    for (int x = 0; x < n; x++) {
+        getch();
+    }
+}
+
+uint8_t AVRISPEngine::spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    write_done();
+    // keep the order of queued instructions
+    spi_flush();
+    uint32_t started = _clock.micros();
+    _spi.transfer(a);
+    _spi.transfer(b);
+    _spi.transfer(c);
+    uint8_t r = _spi.transfer(d);
+    _stats.spi.add(_clock.micros() - started);
+    return r;
+}
+
+void AVRISPEngine::spi_queue(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    write_done();
+    if (_burstLen + 4 > sizeof(_burst)) {
+        spi_flush();
+    }
+    uint8_t* p = _burst + _burstLen;
+    p[0] = a;
+    p[1] = b;
+    p[2] = c;
+    p[3] = d;
+    _burstLen += 4;
+}
+
+void AVRISPEngine::spi_flush() {
+    if (_burstLen) {
+        uint32_t started = _clock.micros();
+        _spi.transferBytes(_burst, nullptr, _burstLen);
+        _stats.spi.add(_clock.micros() - started);
+        _burstLen = 0;
+    }
+}
+
+// read length bytes from (start), a byte address, one read instruction per
+// byte and AVRISP_SPI_BURST / 4 of them per burst
+void AVRISPEngine::spi_read(uint8_t memtype, int start, int length, uint8_t* data) {
+    write_done();
+    int x = 0;
+    while (x < length) {
+        if (memtype == 'F') {
+            load_extended((start + x) >> 1);
+        }
+        spi_flush();
+        int n = 0;
+        for (; x + n < length && n < AVRISP_SPI_BURST / 4; n++) {
+            int addr = start + x + n;
+            if (memtype == 'F' && n && !(addr & 0x1FFFF)) {
+                // next 64K word segment, needs another extended address
+                break;
+            }
+            uint8_t* p = _burst + n * 4;
+            if (memtype == 'F') {
+                // flash is word addressed, 0x28 reads the high byte
+                p[0] = 0x20 + (addr & 1) * 8;
+                addr >>= 1;
+            } else {
+                p[0] = 0xA0;
+            }
+            p[1] = (addr >> 8) & 0xFF;
+            p[2] = addr & 0xFF;
+            p[3] = 0xFF;
+        }
+        // the answer is clocked out with the 4th byte of each instruction
+        uint32_t started = _clock.micros();
+        _spi.transferBytes(_burst, _burst, n * 4);
+        _stats.spi.add(_clock.micros() - started);
+        for (int i = 0; i < n; i++) {
+            data[x + i] = _burst[i * 4 + 3];
+        }
+        x += n;
+    }
+}
+
+// room for len more reply bytes, nullptr if the reply buffer is full
+uint8_t* AVRISPEngine::replyReserve(size_t len) {
+    if (_replyLen + len > _arena.replySize()) {
+        AVRISP_DEBUG("reply overflow");
+        _arena.overflow();
+        error++;
+        return nullptr;
+    }
+    uint8_t* p = _arena.reply() + _replyLen;
+    _replyLen += len;
+    return p;
+}
+
+void AVRISPEngine::reply(const uint8_t* data, size_t len) {
+    uint8_t* p = replyReserve(len);
+    if (p) {
+        memcpy(p, data, len);
+    }
+}
+
+void AVRISPEngine::empty_reply() {
+	char resp[2];
+    if (Sync_CRC_EOP == getch()) {
+    	resp[0] = Resp_STK_INSYNC;
+    	resp[1] = Resp_STK_OK;
+        //_client.print((char)Resp_STK_INSYNC);
+        //_client.print((char)Resp_STK_OK);
+    	reply((const uint8_t *)resp, 2);
+    } else {
+        error++;
+    	resp[0] = Resp_STK_NOSYNC;
+    	resp[1] = Resp_STK_OK;
+        //_client.print((char)Resp_STK_NOSYNC);
+    	reply((const uint8_t *)resp, 2);
+    }
+}
+
+void AVRISPEngine::breply(uint8_t b) {
+    uint8_t resp[3];
+    if (Sync_CRC_EOP == getch()) {
+        resp[0] = Resp_STK_INSYNC;
+        resp[1] = b;
+        resp[2] = Resp_STK_OK;
+        //_client.write((const uint8_t *)resp, (size_t)3);
+        reply((const uint8_t *)resp, 3);
+    } else {
+        error++;
+        //_client.print((char)Resp_STK_NOSYNC);
+        resp[0] = Resp_STK_NOSYNC;
+        resp[1] = b;
+        resp[2] = Resp_STK_OK;
+        reply((const uint8_t *)resp, 3);
+    }
+
+}
+
+void AVRISPEngine::get_parameter(uint8_t c) {
+    switch (c) {
+    case 0x80:
+        breply(AVRISP_HWVER);
+        break;
+    case 0x81:
+        breply(AVRISP_SWMAJ);
+        break;
+    case 0x82:
+        breply(AVRISP_SWMIN);
+        break;
+    case 0x93:
+        breply('S'); // serial programmer
+        break;
+    case Parm_STK_SCK_DURATION: {
+        uint32_t dur = AVRISP_SCK_DURATION_HZ / (_sck ? _sck : 1);
+        breply(dur < 1 ? 1 : dur > 255 ? 255 : dur);
+        break;
+    }
+    default:
+        breply(0);
+    }
+}
+
+void AVRISPEngine::set_parameter(uint8_t c, uint8_t value) {
+    switch (c) {
+    case Parm_STK_SCK_DURATION:
+        // avrdude -B, 0 goes back to the calibrated or set frequency
+        _sckRequested = value ? AVRISP_SCK_DURATION_HZ / value : 0;
+        if (pmode && _sckRequested) {
+            _sck = _sckRequested;
+            _spi.setFrequency(_sck);
+        }
+        AVRISP_DEBUG("host SCK %u Hz", _sckRequested);
+        break;
+    default:
+        // the rest only matter to a real STK500 board
+        break;
+    }
+    empty_reply();
+}
+
+void AVRISPEngine::set_parameters() {
+    // call this after reading paramter packet into buff[]
+    param.devicecode = buff[0];
+    param.revision   = buff[1];
+    param.progtype   = buff[2];
+    param.parmode    = buff[3];
+    param.polling    = buff[4];
+    param.selftimed  = buff[5];
+    param.lockbytes  = buff[6];
+    param.fusebytes  = buff[7];
+    param.flashpoll  = buff[8];
+    // ignore buff[9] (= buff[8])
+    // following are 16 bits (big endian)
+    param.eeprompoll = beget16(&buff[10]);
+    param.pagesize   = beget16(&buff[12]);
+    param.eepromsize = beget16(&buff[14]);
+
+    // 32 bits flashsize (big endian)
+    param.flashsize = buff[16] * 0x01000000
+                    + buff[17] * 0x00010000
+                    + buff[18] * 0x00000100
+                    + buff[19];
+}
+
+void AVRISPEngine::start_pmode() {
+    // RESET is pulsed below, let a running erase or page write finish first
+    write_done();
+    _extAddr = -1;
+    _hostExtAddr = 0;
+    // avrdude enters program mode again right after its 0xAC80 chip erase,
+    // without leaving it, the target is still erased then
+    if (!pmode) {
+        _erased = false;
+    }
+    _verifyAddr = -1;
+    memset(&_verified, 0, sizeof(_verified));
+    // a fallback to data polling only lasts for the session and target it happened on
+    _pollMode = _pollModeSet;
+    _sck = _sckRequested ? _sckRequested : _spi_freq;
+    _spi.begin(_sck);
+    program_enable(true);
+    pmode = 1;
+    uint32_t signature = read_signature_word();
+    apply_device(signature);
+    if (_autoSck && !_sckRequested) {
+        calibrate_sck(signature);
+    }
+}
+
+void AVRISPEngine::apply_device(uint32_t signature) {
+    _deviceKnown = AVRISPDevices::find(signature, _device);
+    if (!_deviceKnown) {
+        // whatever the host set, with the generic worst case times
+        _twdFlash = AVRISP_PTIME * 1000UL;
+        _twdEeprom = AVRISP_EETIME * 1000UL;
+        _twdErase = AVRISP_ERASETIME * 1000UL;
+        return;
+    }
+    AVRISP_DEBUG("%s", _device.name);
+    param.flashsize = _device.flashsize;
+    param.pagesize = _device.pagesize;
+    param.eepromsize = _device.eepromsize;
+    param.eeprompagesize = _device.eeprompagesize;
+    _twdFlash = _device.twd_flash;
+    _twdEeprom = _device.twd_eeprom;
+    _twdErase = _device.twd_erase;
+    if (!(_device.flags & AVRISP_DEVICE_RDYBSY) && _pollMode == AVRISP_POLL_RDYBSY) {
+        _pollMode = AVRISP_POLL_DATA;
+    }
+}
+
+// pulse RESET if asked, then send programming enable. the target echoes the
+// 2nd byte while the 3rd is clocked in when it is in sync
+bool AVRISPEngine::program_enable(bool pulse) {
+    spi_flush();
+    if (pulse) {
+        // try to sync the bus
+        _spi.transfer(0x00);
+        _reset.setReset(false);
+        _clock.delayMicroseconds(50);
+        _reset.setReset(true);
+        _clock.delay(30);
+        // reset cleared the extended address
+        _extAddr = -1;
+    }
+    _spi.transfer(0xAC);
+    _spi.transfer(0x53);
+    uint8_t echo = _spi.transfer(0x00);
+    _spi.transfer(0x00);
+    return echo == 0x53;
+}
+
+uint8_t AVRISPEngine::target_count() {
+    return _select ? _select->targets() : 1;
+}
+
+bool AVRISPEngine::select_target(uint8_t n) {
+    if (!_select) {
+        return n == 0;
+    }
+    // queued instructions still go to every target
+    write_done();
+    spi_flush();
+    return _select->selectTarget(n);
+}
+
+uint32_t AVRISPEngine::read_signature_word() {
+    uint32_t sig = (uint32_t)spi_transaction(0x30, 0x00, 0x00, 0x00) << 16;
+    sig |= (uint32_t)spi_transaction(0x30, 0x00, 0x01, 0x00) << 8;
+    sig |= spi_transaction(0x30, 0x00, 0x02, 0x00);
+    return sig;
+}
+
+// the target keeps up at freq if it echoes programming enable and reads
+// the same signature, twice
+bool AVRISPEngine::sck_stable(uint32_t freq, uint32_t signature) {
+    _spi.setFrequency(freq);
+    // every target of a gang has to keep up
+    uint8_t targets = target_count();
+    bool stable = true;
+    for (uint8_t n = 0; n < targets && stable; n++) {
+        if (targets > 1 && !select_target(n)) {
+            // shared MISO, identical targets answer the same
+            targets = 1;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (!program_enable(false) || read_signature_word() != signature) {
+                stable = false;
+                break;
+            }
+        }
+    }
+    if (target_count() > 1) {
+        select_target(0);
+    }
+    return stable;
+}
+
+void AVRISPEngine::calibrate_sck(uint32_t signature) {
+    if (signature == 0 || signature == 0xFFFFFF) {
+        // no target or not in sync, stay slow
+        return;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < AVRISP_SCK_PROFILES; i++) {
+        if (_sckProfiles[i].signature == signature) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0) {
+        if (_sckProfiles[slot].freq <= _spi_freq) {
+            // did not go faster than the set frequency last time
+            return;
+        }
+        if (sck_stable(_sckProfiles[slot].freq, signature)) {
+            _sck = _sckProfiles[slot].freq;
+            AVRISP_DEBUG("SCK %u Hz from profile", _sck);
+            return;
+        }
+        // e.g. another board with the same part, calibrate again
+        _spi.setFrequency(_spi_freq);
+        program_enable(true);
+    }
+
+    // step up until the target misses, then back off one more step
+    uint32_t good = _spi_freq;
+    uint32_t margin = _spi_freq;
+    bool failed = false;
+    for (size_t i = 0; i < sizeof(sck_steps) / sizeof(sck_steps[0]); i++) {
+        if (sck_steps[i] <= _spi_freq) {
+            continue;
+        }
+        if (!sck_stable(sck_steps[i], signature)) {
+            failed = true;
+            break;
+        }
+        margin = good;
+        good = sck_steps[i];
+    }
+    // also when the top step passed: two signature reads are no proof the
+    // part is within spec there
+    _sck = margin;
+    _spi.setFrequency(_sck);
+    if (failed) {
+        // the target may have lost the instruction frame
+        program_enable(true);
+    }
+
+    if (slot < 0) {
+        slot = _sckNext;
+        _sckNext = (_sckNext + 1) % AVRISP_SCK_PROFILES;
+    }
+    _sckProfiles[slot].signature = signature;
+    _sckProfiles[slot].freq = _sck;
+    AVRISP_DEBUG("SCK %u Hz for %06x", _sck, signature);
+}
+
+void AVRISPEngine::end_pmode() {
+    // do not release RESET in the middle of a write cycle
+    write_done();
+    finishVerify();
+    _spi.end();
+    _reset.setReset(_reset_state);
+    pmode = 0;
+}
+
+void AVRISPEngine::universal() {
+    uint8_t ch;
+
+    fill(4);
+    if (buff[0] == 0xAC && (buff[1] & 0xE0) == 0x80) {
+        // chip erase as avrdude sends it
+        chip_erase();
+        ch = buff[3];
+    } else if (buff[0] == 0x4D) {
+        // load extended address, avrdude sends it ahead of LOAD_ADDRESS
+        _hostExtAddr = buff[2];
+        ch = spi_transaction(buff[0], buff[1], buff[2], buff[3]);
+        _extAddr = buff[2];
+    } else {
+        ch = spi_transaction(buff[0], buff[1], buff[2], buff[3]);
+    }
+    breply(ch);
+}
+
+// start the erase and return, so the reply goes out and the first pages
+// are uploaded while the target erases. whatever talks to the target next
+// waits for it to finish
+void AVRISPEngine::chip_erase() {
+    spi_transaction(0xAC, 0x80, 0x00, 0x00);
+    _running = 'C';
+    _runningSince = _clock.micros();
+    // every page reads 0xFF from now on
+    _erased = true;
+}
+
+void AVRISPEngine::finish_write() {
+    uint8_t memtype = _running;
+    _running = 0;
+    wait_ready(memtype, memtype == 'F' ? _pollAddr : -1, _pollValue, _runningSince);
+    _pollAddr = -1;
+}
+
+bool AVRISPEngine::ready() {
+    if (!_running) {
+        return true;
+    }
+    uint32_t elapsed = _clock.micros() - _runningSince;
+    uint32_t budget = write_budget(_running);
+    bool done = elapsed >= 2 * budget;
+    if (!done && _pollMode == AVRISP_POLL_RDYBSY && target_count() == 1) {
+        // nothing may be queued behind a running write, the bus is free
+        _spi.transfer(0xF0);
+        _spi.transfer(0x00);
+        _spi.transfer(0x00);
+        done = !(_spi.transfer(0x00) & 0x01);
+    } else if (!done) {
+        // the other modes need the bus for longer, wait the budget out
+        done = elapsed >= budget;
+    }
+    if (done) {
+        // records the write time, returns at once
+        write_done();
+    }
+    return done;
+}
+
+uint32_t AVRISPEngine::write_budget(uint8_t memtype) {
+    return memtype == 'C' ? _twdErase : memtype == 'E' ? _twdEeprom : _twdFlash;
+}
+
+// select the 64K word segment of flash word address addr on parts that have
+// more than one. the target keeps it until the next 0x4D or reset, so it is
+// only sent when it changes
+void AVRISPEngine::load_extended(int addr) {
+    int ext = (addr >> 16) & 0xFF;
+    if (ext == _extAddr || (ext == 0 && param.flashsize <= 0x20000)) {
+        return;
+    }
+    spi_queue(0x4D, 0x00, ext, 0x00);
+    _extAddr = ext;
+}
+
+void AVRISPEngine::flash(uint8_t hilo, int addr, uint8_t data) {
+    spi_queue(0x40 + 8 * hilo,
+                    addr >> 8 & 0xFF,
+                    addr & 0xFF,
+                    data);
+    // remember a byte data polling can tell from a busy read
+    if (data != param.flashpoll) {
+        _pollAddr = addr * 2 + hilo;
+        _pollValue = data;
+    }
+}
+
+void AVRISPEngine::commit(int addr) {
+    load_extended(addr);
+    spi_transaction(0x4C, (addr >> 8) & 0xFF, addr & 0xFF, 0);
+    // like the erase, the next access to the target waits for the write
+    _running = 'F';
+    _runningSince = _clock.micros();
+}
+
+// wait until the write cycle started on the target is over. addr and value
+// are what data polling reads back, addr < 0 if nothing readable was written
+bool AVRISPEngine::wait_ready(uint8_t memtype, int addr, uint8_t value, uint32_t started) {
+    uint32_t entered = _clock.micros();
+    bool eeprom = memtype == 'E';
+    bool erase = memtype == 'C';
+    AVRISP_writetime_t& t = erase ? _eraseTime : eeprom ? _eepromTime : _flashTime;
+    uint32_t budget = write_budget(memtype);
+    // polling stops as soon as the part is ready, so give a slow one twice
+    // the datasheet time before giving up on it
+    uint32_t timeout = _deviceKnown ? budget * 2 : budget;
+    AVRISPPollMode_t mode = _pollMode;
+    if (mode == AVRISP_POLL_DATA && addr < 0) {
+        mode = AVRISP_POLL_DELAY;
+    }
+
+    uint8_t targets = target_count();
+    if (targets > 1 && !select_target(0)) {
+        // a shared MISO can not tell which target is still busy
+        mode = AVRISP_POLL_DELAY;
+    }
+
+    bool ready = true;
+    if (mode == AVRISP_POLL_DELAY) {
+        // the part of the budget that has not passed yet
+        uint32_t waited = _clock.micros() - started;
+        if (waited < budget) {
+            _clock.delay((budget - waited + 999) / 1000);
+        }
+    } else {
+        // all targets started the write together, wait for the slowest
+        for (uint8_t n = 0; n < targets && ready; n++) {
+            if (n) {
+                select_target(n);
+            }
+            while (true) {
+                if (mode == AVRISP_POLL_RDYBSY) {
+                    ready = !(spi_transaction(0xF0, 0x00, 0x00, 0x00) & 0x01);
+                } else if (eeprom) {
+                    ready = spi_transaction(0xA0, (addr >> 8) & 0xFF, addr & 0xFF, 0xFF) == value;
+                } else {
+                    ready = flash_read(addr & 1, addr >> 1) == value;
+                }
+                if (ready || _clock.micros() - started > timeout) {
+                    break;
+                }
+                _clock.yield();
+            }
+        }
+        if (targets > 1) {
+            select_target(0);
+        }
+    }
+    uint32_t elapsed = _clock.micros() - started;
+    // only the part nothing else could be done in
+    _stats.wait.add(_clock.micros() - entered);
+
+    if (!ready) {
+        // the full worst case has passed, so the write is done anyway
+        t.timeouts++;
+        if (mode == AVRISP_POLL_RDYBSY) {
+            AVRISP_DEBUG("RDY/BSY timeout, data polling until program mode is entered again");
+            _pollMode = AVRISP_POLL_DATA;
+        }
+    }
+    t.last_us = elapsed;
+    if (!t.count || elapsed < t.min_us) t.min_us = elapsed;
+    if (elapsed > t.max_us) t.max_us = elapsed;
+    t.total_us += elapsed;
+    t.count++;
+    return ready;
+}
+
+//#define _addr_page(x) (here & 0xFFFFE0)
+int AVRISPEngine::addr_page(int addr) {
+    // addr is a word address, pages are a power of two bytes
+    int words = param.pagesize / 2;
+    if (words > 0 && !(words & (words - 1))) {
+        return addr & ~(words - 1);
+    }
+    AVRISP_DEBUG("unknown page size: %d", param.pagesize);
+    return addr;
+}
+
+
+void AVRISPEngine::write_flash(int length) {
+    bool fits = fill(length);
+	
+	uint8_t resp[2];
+
+    if (Sync_CRC_EOP == getch()) {
+        //_client.print((char) Resp_STK_INSYNC);
+        //_client.print((char) write_flash_pages(length));
+		resp[0] = Resp_STK_INSYNC;
+		resp[1] = fits ? write_flash_pages(length) : Resp_STK_FAILED;
+		reply((const uint8_t *)resp, 2);
+    } else {
+      error++;
+      //_client.print((char) Resp_STK_NOSYNC);
+	  resp[0] = Resp_STK_NOSYNC;
+	  reply((const uint8_t *)resp, 1);
+    }
+}
+
+uint8_t AVRISPEngine::write_flash_pages(int length) {
+    int x = 0;
+    while (x < length) {
+        _clock.yield();
+        int page = addr_page(here);
+        // the part of buff that goes to this page
+        int n = 0;
+        while (x + n < length && addr_page(here + n / 2) == page) {
+            n += 2;
+        }
+        int todo = skip_flash_page(here, buff + x, n);
+        if (todo == AVRISP_PAGE_NEEDS_ERASE) {
+            // written over, the old bits would be mixed into the new data
+            error++;
+            return Resp_STK_FAILED;
+        }
+        if (todo == AVRISP_PAGE_WRITE) {
+            if (_verify) {
+                // read back the previous page now, its write has to be over
+                // before this one is loaded anyway. after the commit the
+                // write cycle of this page is left running
+                finishVerify();
+            }
+            for (int i = 0; i < n; i += 2) {
+                flash(0, here + i / 2, buff[x + i]);
+                flash(1, here + i / 2, buff[x + i + 1]);
+            }
+            commit(page);
+            _pages.written++;
+            _stats.flashBytes += n;
+            if (_verify) {
+                // read back with the next page or finishVerify()
+                _verifyAddr = here;
+                _verifyLen = n;
+                _verifyCrc = crc32(0, buff + x, n);
+                _verified.expected = crc32(_verified.expected, buff + x, n);
+            }
+        }
+        here += n / 2;
+        x += n;
+    }
+    return Resp_STK_OK;
+}
+
+void AVRISPEngine::finishVerify() {
+    if (_verifyAddr < 0 || !pmode) {
+        return;
+    }
+    int addr = _verifyAddr;
+    _verifyAddr = -1;
+    uint8_t targets = target_count();
+    if (targets > 1 && !select_target(0)) {
+        // a shared MISO mixes the answers of the targets
+        return;
+    }
+    bool failed = false;
+    uint8_t chunk[AVRISP_SPI_BURST / 4];
+    for (uint8_t t = 0; t < targets; t++) {
+        if (t) {
+            select_target(t);
+        }
+        uint32_t crc = 0;
+        for (int x = 0; x < _verifyLen; x += sizeof(chunk)) {
+            int n = _verifyLen - x < (int)sizeof(chunk) ? _verifyLen - x : sizeof(chunk);
+            spi_read('F', addr * 2 + x, n, chunk);
+            crc = crc32(crc, chunk, n);
+            if (t == 0) {
+                _verified.crc32 = crc32(_verified.crc32, chunk, n);
+            }
+        }
+        _stats.verifiedBytes += _verifyLen;
+        if (crc != _verifyCrc) {
+            AVRISP_DEBUG("verify failed at %04x on target %u", addr * 2, t);
+            _verified.failed_targets |= 1UL << t;
+            failed = true;
+        }
+    }
+    if (targets > 1) {
+        select_target(0);
+    }
+    _verified.pages++;
+    if (failed) {
+        if (!_verified.failed) {
+            _verified.first_bad = addr * 2;
+        }
+        _verified.failed++;
+    }
+}
+
+uint32_t AVRISPEngine::crc32(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// what to do with a flash page at (addr), a word address: AVRISP_PAGE_SKIP if
+// the target already holds the length bytes of data (or they are blank after a
+// chip erase), AVRISP_PAGE_WRITE if it has to be written. the target has no
+// page erase, a write only clears bits: without a chip erase a page that needs
+// a bit set is AVRISP_PAGE_NEEDS_ERASE
+int AVRISPEngine::skip_flash_page(int addr, const uint8_t* data, int length) {
+    if (_erased) {
+        int i = 0;
+        while (i < length && data[i] == 0xFF) {
+            i++;
+        }
+        if (i == length) {
+            _pages.blank++;
+            return AVRISP_PAGE_SKIP;
+        }
+    }
+    if (!_incremental || _erased) {
+        // an erased target can not hold anything but blank pages
+        return AVRISP_PAGE_WRITE;
+    }
+    // a gang skips the page only if every target holds it
+    uint8_t targets = target_count();
+    if (targets > 1 && !select_target(0)) {
+        return AVRISP_PAGE_WRITE;
+    }
+    bool same = true;
+    bool writable = true;
+    uint8_t chunk[AVRISP_SPI_BURST / 4];
+    for (uint8_t t = 0; t < targets && writable; t++) {
+        if (t) {
+            select_target(t);
+        }
+        for (int x = 0; x < length && writable; x += sizeof(chunk)) {
+            int n = length - x < (int)sizeof(chunk) ? length - x : sizeof(chunk);
+            spi_read('F', addr * 2 + x, n, chunk);
+            for (int i = 0; i < n; i++) {
+                same = same && chunk[i] == data[x + i];
+                writable = writable && (chunk[i] & data[x + i]) == data[x + i];
+            }
+        }
+    }
+    if (targets > 1) {
+        select_target(0);
+    }
+    if (!writable) {
+        AVRISP_DEBUG("page %04x needs a chip erase", addr * 2);
+        _pages.needs_erase++;
+        return AVRISP_PAGE_NEEDS_ERASE;
+    }
+    if (!same) {
+        return AVRISP_PAGE_WRITE;
+    }
+    _pages.unchanged++;
+    return AVRISP_PAGE_SKIP;
+}
+
+uint8_t AVRISPEngine::write_eeprom(int length) {
+    // here is a word address, get the byte address. a 0x4D left over
+    // from the flash does not apply to the EEPROM
+    int start = (here & 0xFFFF) * 2;
+    int remaining = length;
+    if (length > param.eepromsize) {
+        error++;
+        skip(length);
+        return Resp_STK_FAILED;
+    }
+    _stats.eepromBytes += length;
+    while (remaining > EECHUNK) {
+        write_eeprom_chunk(start, EECHUNK);
+        start += EECHUNK;
+        remaining -= EECHUNK;
+    }
+    write_eeprom_chunk(start, remaining);
+    return Resp_STK_OK;
+}
+// write (length) bytes, (start) is a byte address
+uint8_t AVRISPEngine::write_eeprom_chunk(int start, int length) {
+    fill(length);
+    int pagesize = param.eeprompagesize;
+    // prog_lamp(LOW);
+    if (pagesize <= 1 || (pagesize & (pagesize - 1))) {
+        // no (sensible) page size, older parts only write byte by byte
+        for (int x = 0; x < length; x++) {
+            int addr = start + x;
+            spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, buff[x]);
+            wait_ready('E', eeprom_pollable(buff[x]) ? addr : -1, buff[x], _clock.micros());
+        }
+        return Resp_STK_OK;
+    }
+    // load the page buffer, one write cycle per EEPROM page
+    int pollAddr = -1;
+    uint8_t pollValue = 0xFF;
+    for (int x = 0; x < length; x++) {
+        int addr = start + x;
+        spi_queue(0xC1, 0x00, addr & (pagesize - 1), buff[x]);
+        if (eeprom_pollable(buff[x])) {
+            pollAddr = addr;
+            pollValue = buff[x];
+        }
+        if (x == length - 1 || ((addr + 1) & (pagesize - 1)) == 0) {
+            int page = addr & ~(pagesize - 1);
+            spi_transaction(0xC2, (page >> 8) & 0xFF, page & 0xFF, 0x00);
+            wait_ready('E', pollAddr, pollValue, _clock.micros());
+            pollAddr = -1;
+        }
+    }
+    // prog_lamp(HIGH);
+    return Resp_STK_OK;
+}
+
+// the EEPROM poll values can not be told from a busy read
+bool AVRISPEngine::eeprom_pollable(uint8_t value) {
+    return value != (param.eeprompoll >> 8) && value != (param.eeprompoll & 0xFF);
+}
+
+void AVRISPEngine::program_page() {
+    char result = (char) Resp_STK_FAILED;
+    int length = 256 * getch();
+    length += getch();
+    char memtype = getch();
+    // flash memory @here, (length) bytes
+    if (memtype == 'F') {
+        write_flash(length);
+        return;
+    }
+
+	uint8_t resp[2];
+    if (memtype == 'E') {
+        result = (char)write_eeprom(length);
+        if (Sync_CRC_EOP == getch()) {
+            //_client.print((char) Resp_STK_INSYNC);
+            //_client.print(result);
+			resp[0] = Resp_STK_INSYNC;
+			resp[1] = result;
+			reply((const uint8_t *)resp, 2);
+        } else {
+            error++;
+            //_client.print((char) Resp_STK_NOSYNC);
+			resp[0] = Resp_STK_NOSYNC;
+			reply((const uint8_t *)resp, 1);
+        }
+        return;
+    }
+    //_client.print((char)Resp_STK_FAILED);
+    // unknown memory type, drop its data and the EOP
+    skip(length + 1);
+	resp[0] = Resp_STK_NOSYNC;
+	reply((const uint8_t *)resp, 1);
+	return;
+
+}
+
+uint8_t AVRISPEngine::flash_read(uint8_t hilo, int addr) {
+    load_extended(addr);
+    return spi_transaction(0x20 + hilo * 8,
+                           (addr >> 8) & 0xFF,
+                           addr & 0xFF,
+                           0);
+}
+
+void AVRISPEngine::flash_read_page(int length, uint8_t* data) {
+    spi_read('F', here * 2, length, data);
+    here += (length + 1) / 2;
+    *(data + length) = Resp_STK_OK;
+    //_client.write((const uint8_t *)data, (size_t)(length + 1));
+    //free(data);
+    return;
+}
+
+void AVRISPEngine::eeprom_read_page(int length, uint8_t* data) {
+    // here again we have a word address
+    spi_read('E', (here & 0xFFFF) * 2, length, data);
+    *(data + length) = Resp_STK_OK;
+    return;
+}
+
+void AVRISPEngine::read_page() {
+    int length = 256 * getch();
+    length += getch();
+    char memtype = getch();
+	uint8_t resp[1];
+    if (Sync_CRC_EOP != getch()) {
+        error++;
+        //_client.print((char) Resp_STK_NOSYNC);
+		resp[0] = Resp_STK_NOSYNC;
+		reply((const uint8_t *)resp, 1);
+        return;
+    }
+    if (memtype != 'F' && memtype != 'E') {
+		resp[0] = Resp_STK_FAILED;
+		reply((const uint8_t *)resp, 1);
+        return;
+    }
+	// read straight into the reply buffer
+	uint8_t *data = replyReserve(length + 2);
+	if (!data) {
+		resp[0] = Resp_STK_FAILED;
+		reply((const uint8_t *)resp, 1);
+		return;
+	}
+    //_client.print((char) Resp_STK_INSYNC);
+	*data = Resp_STK_INSYNC;
+    if (memtype == 'F') flash_read_page(length, data + 1);
+    if (memtype == 'E') eeprom_read_page(length, data + 1);
+    return;
+}
+
+void AVRISPEngine::read_signature() {
+	uint8_t resp[5];
+    if (Sync_CRC_EOP != getch()) {
+        error++;
+        //_client.print((char) Resp_STK_NOSYNC);
+		resp[0] = Resp_STK_NOSYNC;
+		reply((const uint8_t *)resp, 1);
+        return;
+    }
+    //_client.print((char) Resp_STK_INSYNC);
+    uint8_t high = spi_transaction(0x30, 0x00, 0x00, 0x00);
+    //_client.print((char) high);
+    uint8_t middle = spi_transaction(0x30, 0x00, 0x01, 0x00);
+    //_client.print((char) middle);
+    uint8_t low = spi_transaction(0x30, 0x00, 0x02, 0x00);
+    //_client.print((char) low);
+    //_client.print((char) Resp_STK_OK);
+	resp[0] = Resp_STK_INSYNC;
+	resp[1] = high;
+	resp[2] = middle;
+	resp[3] = low;
+	resp[4] = Resp_STK_OK;
+	reply((const uint8_t *)resp, 5);
+	AVRISP_DEBUG("signature %02x %02x %02x", high, middle, low);
+}
+
+// It seems ArduinoISP is based on the original STK500 (not v2)
+// but implements only a subset of the commands.
+void AVRISPEngine::avrisp() {
+    uint8_t data;
+    uint8_t ch = getch();
+	char resp[9];
+    AVRISP_DEBUG("CMD 0x%02x", ch);
+    if (ch >= AVRISP_STK_FIRST && ch < AVRISP_STK_FIRST + AVRISP_STK_COMMANDS) {
+        _stats.commands[ch - AVRISP_STK_FIRST]++;
+    } else {
+        _stats.unknown++;
+    }
+    switch (ch) {
+    case Cmnd_STK_GET_SYNC:
+        error = 0;
+        empty_reply();
+        break;
+
+    case Cmnd_STK_GET_SIGN_ON:
+        if (getch() == Sync_CRC_EOP) {
+            //_client.print((char) Resp_STK_INSYNC);
+            //_client.print(F("AVR ISP")); // AVR061 says "AVR STK"?
+            //_client.print((char) Resp_STK_OK);
+			resp[0] = Resp_STK_INSYNC;
+			resp[1] = 'A';
+			resp[2] = 'V';
+			resp[3] = 'R';
+			resp[4] = ' ';
+			resp[5] = 'I';
+			resp[6] = 'S';
+			resp[7] = 'P';
+			resp[8] = Resp_STK_OK;
+			reply((const uint8_t *)resp, 9);
+        }
+        break;
+
+    case Cmnd_STK_GET_PARAMETER:
+        get_parameter(getch());
+        break;
+
+    case Cmnd_STK_SET_PARAMETER:
+        data = getch();
+        set_parameter(data, getch());
+        break;
+
+    case Cmnd_STK_SET_DEVICE:
+        fill(20);
+        set_parameters();
+        empty_reply();
+        break;
+
+    case Cmnd_STK_SET_DEVICE_EXT:
+        // command size, EEPROM page size, pagel, bs2, reset disposition
+        fill(5);
+        param.eeprompagesize = buff[1];
+        empty_reply();
+        break;
+
+    case Cmnd_STK_CHIP_ERASE:
+        if (Sync_CRC_EOP == getch()) {
+            if (pmode) {
+                chip_erase();
+            }
+            resp[0] = Resp_STK_INSYNC;
+            resp[1] = pmode ? Resp_STK_OK : Resp_STK_FAILED;
+            reply((const uint8_t *)resp, 2);
+        } else {
+            error++;
+            resp[0] = Resp_STK_NOSYNC;
+            reply((const uint8_t *)resp, 1);
+        }
+        break;
+
+    case Cmnd_STK_ENTER_PROGMODE:
+        start_pmode();
+        empty_reply();
+        break;
+
+    case Cmnd_STK_LOAD_ADDRESS:
+        here = getch();
+        here += 256 * getch();
+        // above 64K words the host sent the high byte with 0x4D before
+        here += (int)_hostExtAddr << 16;
+        // AVRISP_DEBUG("here=0x%04x", here);
+        empty_reply();
+        break;
+
+    // XXX: not implemented!
+    case Cmnd_STK_PROG_FLASH:
+        getch();    // low
+        getch();    // high
+        empty_reply();
+        break;
+
+    // XXX: not implemented!
+    case Cmnd_STK_PROG_DATA:
+        data = getch();
+        empty_reply();
+        break;
+
+    case Cmnd_STK_PROG_PAGE:
+        program_page();
+        break;
+
+    case Cmnd_STK_READ_PAGE:
+        read_page();
+        break;
+
+    case Cmnd_STK_UNIVERSAL:
+        universal();
+        break;
+
+    case Cmnd_STK_LEAVE_PROGMODE:
+        error = 0;
+        end_pmode();
+        empty_reply();
+        _clock.delay(5);
+        // if (_client && _client.connected())
+        //_client.stop();
+        // AVRISP_DEBUG("left progmode");
+		setReset(false);
+        break;
+
+    case Cmnd_STK_READ_SIGN:
+        read_signature();
+        break;
+        // expecting a command, not Sync_CRC_EOP
+        // this is how we can get back in sync
+    case Sync_CRC_EOP:       // 0x20, space
+        error++;
+        //_client.print((char) Resp_STK_NOSYNC);
+		resp[0] = Resp_STK_NOSYNC;
+		reply((const uint8_t *)resp, 1);
+        break;
+
+      // anything else we will return STK_UNKNOWN
+    default:
+        AVRISP_DEBUG("unknown command 0x%02x", ch);
+        error++;
+        if (Sync_CRC_EOP == getch()) {
+            //_client.print((char)Resp_STK_UNKNOWN);
+			resp[0] = Resp_STK_UNKNOWN;
+			reply((const uint8_t *)resp, 1);
+        } else {
+            //_client.print((char)Resp_STK_NOSYNC);
+			resp[0] = Resp_STK_NOSYNC;
+			reply((const uint8_t *)resp, 1);
+        }
+  }
+}
@@ -0,0 +1,328 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Original version:
+	AVR In-System Programming over WiFi for ESP8266
+	Copyright (c) Kiril Zyapkov <kiril@robotev.com>
+
+    ArduinoISP version 04m3
+    Copyright (c) 2008-2011 Randall Bohn
+    If you require a license, see
+        http://www.opensource.org/licenses/bsd-license.php
+
+STK500 (v1) programmer engine. It reads commands from an AVRISPTransport,
+drives the target through the AVRISPSpi / AVRISPResetPin / AVRISPClock
+interfaces and queues the replies in the arena reply buffer. It does not
+depend on the Arduino core.
+*/
+
+#ifndef AVRISPENGINE_H
+#define AVRISPENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "AVRISPInterfaces.h"
+#include "AVRISPArena.h"
+#include "AVRISPDevices.h"
+#include "AVRISPStats.h"
+
+// bytes clocked out in one SPI burst, the size of the HSPI FIFO
+#define AVRISP_SPI_BURST 64
+
+// SCK calibration at program mode entry, 0 always uses the set frequency
+#ifndef AVRISP_AUTO_SCK
+#define AVRISP_AUTO_SCK 1
+#endif
+
+// targets whose calibrated SCK is remembered, by signature
+#define AVRISP_SCK_PROFILES 4
+
+// stk500 parameters
+typedef struct {
+    uint8_t devicecode;
+    uint8_t revision;
+    uint8_t progtype;
+    uint8_t parmode;
+    uint8_t polling;
+    uint8_t selftimed;
+    uint8_t lockbytes;
+    uint8_t fusebytes;
+    int flashpoll;
+    int eeprompoll;
+    int pagesize;
+    int eepromsize;
+    int flashsize;
+    int eeprompagesize;     // from SET_DEVICE_EXT, 0 writes the EEPROM byte by byte
+} AVRISP_parameter_t;
+
+// how the end of a flash page or EEPROM write is detected
+typedef enum {
+    AVRISP_POLL_RDYBSY = 0,     // 0xF0 poll RDY/BSY instruction
+    AVRISP_POLL_DATA,           // read the written location until it holds the new value
+    AVRISP_POLL_DELAY           // worst case delay, no polling
+} AVRISPPollMode_t;
+
+// observed write cycle times, in us
+typedef struct {
+    uint32_t count;
+    uint32_t timeouts;          // writes that did not report ready in time
+    uint32_t last_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t total_us;
+} AVRISP_writetime_t;
+
+// flash pages handed to the engine and what was done with them
+typedef struct {
+    uint32_t written;
+    uint32_t blank;             // all 0xFF after a chip erase, skipped
+    uint32_t unchanged;         // target already held the data, skipped
+    uint32_t needs_erase;       // incremental, not erased and a bit to set: failed
+} AVRISP_pagecount_t;
+
+// what skip_flash_page() found for a page
+typedef enum {
+    AVRISP_PAGE_WRITE = 0,
+    AVRISP_PAGE_SKIP,
+    AVRISP_PAGE_NEEDS_ERASE     // only a chip erase sets the bits it needs
+} AVRISPPageAction_t;
+
+// read back of the flash pages written since program mode was entered
+typedef struct {
+    uint32_t pages;             // pages read back
+    uint32_t failed;            // pages that did not read back as written
+    uint32_t first_bad;         // byte address of the first failed page
+    uint32_t crc32;             // CRC32 of all read back data, in write order
+    uint32_t expected;          // CRC32 of the data written to those pages
+    uint32_t failed_targets;    // bit per target with a failed page, see setTargets()
+} AVRISP_verify_t;
+
+class AVRISPEngine
+{
+public:
+    // the arena provides the page and reply buffers, it must be constructed first
+    AVRISPEngine(AVRISPSpi& spi, AVRISPResetPin& reset, AVRISPClock& clock, AVRISPArena& arena, uint32_t spi_freq);
+
+    // run commands until the transport has no more, replies are queued
+    void run(AVRISPTransport& in);
+
+    // run exactly one command
+    void command(AVRISPTransport& in);
+
+    // replies queued since the last clearReply()
+    uint8_t* reply() const { return _arena.reply(); }
+    size_t replyLen() const { return _replyLen; }
+    void clearReply() { _replyLen = 0; }
+
+    // set the SPI clock frequency, the floor of the SCK calibration
+    void setSpiFrequency(uint32_t);
+
+    // step SCK up at program mode entry as long as the target answers
+    // reliably, and remember the result per signature
+    void setAutoSck(bool enable) { _autoSck = enable; }
+    // SCK in use, calibrated, requested by the host or set
+    uint32_t sckFrequency() const { return _sck; }
+    // forget the calibrated profiles
+    void clearSckProfiles();
+
+    // control the state of the RESET pin of the target, also the state
+    // it is left in when programming mode ends
+    void setReset(bool);
+
+    // program several targets on one bus at once (gang programming). every
+    // instruction goes to all of them, so their write cycles overlap; reads
+    // for polling, incremental compare and verify are done per target
+    void setTargets(AVRISPTargetSelect* select) { _select = select; }
+    uint8_t targets() { return target_count(); }
+    // target that answers reads, e.g. readSignature()
+    bool selectTarget(uint8_t n) { return select_target(n); }
+
+    bool inProgramMode() const { return pmode; }
+    void startProgramMode() { start_pmode(); }
+    void endProgramMode() { end_pmode(); }
+
+    // signature of the target as 0x1e950f, 0 when not in program mode
+    uint32_t readSignature() { return pmode ? read_signature_word() : 0; }
+
+    // start a chip erase, the next instruction to the target waits for it.
+    // flash page writes are left running the same way
+    void chipErase() { chip_erase(); }
+    // true when no erase or page write is running any more, polls the
+    // target once and never waits. lets a caller do other work meanwhile
+    bool ready();
+    bool erased() const { return _erased; }
+
+    // entry of the target in the device table, read at program mode entry.
+    // it sets the sizes in parameters() and the write time budget, the host
+    // can still override the parameters with SET_DEVICE afterwards.
+    // nullptr for a part the table does not know
+    const AVRISP_device_t* device() const { return _deviceKnown ? &_device : nullptr; }
+
+    AVRISP_parameter_t& parameters() { return param; }
+    int errors() const { return error; }
+
+    // command counts, bytes and timing histograms since start or clearStats()
+    const AVRISP_stats_t& stats() const { return _stats; }
+    void clearStats() { memset(&_stats, 0, sizeof(_stats)); }
+
+    // RDY/BSY by default, falls back to data polling when the target
+    // never reports ready, until program mode is entered again
+    void setPollMode(AVRISPPollMode_t mode) { _pollModeSet = _pollMode = mode; }
+    // mode in use, after a fallback it differs from the set one
+    AVRISPPollMode_t pollMode() const { return _pollMode; }
+
+    const AVRISP_writetime_t& flashWriteTime() const { return _flashTime; }
+
+    // read each flash page back before writing it and skip the ones that
+    // already match. blank pages after a chip erase are always skipped.
+    // without a chip erase a page that needs a 0 bit set fails the write
+    // (Resp_STK_FAILED) and is left as it was
+    void setIncremental(bool enable) { _incremental = enable; }
+    bool incremental() const { return _incremental; }
+    const AVRISP_pagecount_t& pageCount() const { return _pages; }
+
+    // read every written flash page back and check its CRC32. a page is
+    // read back right before the next one is loaded, once its write cycle is
+    // over; the read back itself does not overlap anything, the write cycle
+    // of the new page then runs while the reply is sent and the next upload
+    // arrives. finishVerify() reads the last one
+    void setVerify(bool enable) { _verify = enable; }
+    bool verify() const { return _verify; }
+    void finishVerify();
+    const AVRISP_verify_t& verifyResult() const { return _verified; }
+
+    // zlib compatible CRC32, crc is the result of the previous call or 0
+    static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t len);
+    const AVRISP_writetime_t& eepromWriteTime() const { return _eepromTime; }
+    const AVRISP_writetime_t& eraseTime() const { return _eraseTime; }
+
+    // program length bytes from the page buffer at a byte address
+    uint8_t writeFlash(uint32_t addr, int length);
+
+    // read length bytes of flash ('F') or EEPROM ('E') from a byte address
+    // in SPI bursts, in program mode
+    void readMemory(uint8_t memtype, uint32_t addr, int length, uint8_t* data) { spi_read(memtype, addr, length, data); }
+
+protected:
+    void avrisp(void);          // handle one incoming STK500 command
+
+    uint8_t getch(void);        // retrieve a character from the remote end
+    void reply(const uint8_t*, size_t); // queue reply bytes for the remote end
+    uint8_t* replyReserve(size_t);      // room for reply bytes, nullptr if full
+    uint8_t spi_transaction(uint8_t, uint8_t, uint8_t, uint8_t);
+    void spi_queue(uint8_t, uint8_t, uint8_t, uint8_t);    // instruction for the next burst
+    void spi_flush(void);                                   // clock out the queued instructions
+    void spi_read(uint8_t memtype, int start, int length, uint8_t* data);
+    void empty_reply(void);
+    void breply(uint8_t);
+
+    void get_parameter(uint8_t);
+    void set_parameter(uint8_t, uint8_t);
+    void set_parameters(void);
+    int addr_page(int);
+    void load_extended(int);    // 0x4D for the segment of a flash word address
+    void flash(uint8_t, int, uint8_t);
+    void write_flash(int);
+    uint8_t write_flash_pages(int length);
+    int skip_flash_page(int addr, const uint8_t* data, int length);
+    uint8_t write_eeprom(int length);
+    uint8_t write_eeprom_chunk(int start, int length);
+    bool eeprom_pollable(uint8_t value);
+    void commit(int addr);
+    // wait for the write cycle of addr started at micros() started
+    bool wait_ready(uint8_t memtype, int addr, uint8_t value, uint32_t started);
+    uint32_t write_budget(uint8_t memtype);
+    void chip_erase(void);
+    void write_done(void) { if (_running) finish_write(); }
+    void finish_write(void);
+    void program_page();
+    uint8_t flash_read(uint8_t hilo, int addr);
+    void flash_read_page(int length, uint8_t* data);
+    void eeprom_read_page(int length, uint8_t* data);
+    void read_page();
+    void read_signature();
+
+    void universal(void);
+
+    uint8_t target_count(void);
+    bool select_target(uint8_t);  // MISO from target n, false if it can not be switched
+
+    bool fill(int);             // fill the buffer with n bytes, false if too long
+    void skip(int);             // consume n command bytes
+    bool program_enable(bool pulse);    // 0xAC53, true if the target echoed 0x53
+    uint32_t read_signature_word(void);
+    bool sck_stable(uint32_t freq, uint32_t signature);
+    void calibrate_sck(uint32_t signature);     // pick _sck for the target in program mode
+    void apply_device(uint32_t signature);      // parameters and write times from the device table
+    void start_pmode(void);     // enter program mode
+    void end_pmode(void);       // exit program mode
+
+    AVRISPSpi& _spi;
+    AVRISPResetPin& _reset;
+    AVRISPClock& _clock;
+    AVRISPArena& _arena;
+    AVRISPTransport* _in;       // transport of the running command
+    AVRISPTargetSelect* _select;    // gang of targets, nullptr for one
+
+    // page buffer
+    uint8_t* buff;
+    // queued write instructions, or read instructions and their answers
+    uint8_t _burst[AVRISP_SPI_BURST];
+    size_t _burstLen;
+    size_t _replyLen;
+
+    uint32_t _spi_freq;
+    bool _reset_state;
+
+    uint32_t _sck;              // SCK in use
+    uint32_t _sckRequested;     // from Parm_STK_SCK_DURATION, 0 if the host did not ask
+    bool _autoSck;
+    struct {
+        uint32_t signature;
+        uint32_t freq;
+    } _sckProfiles[AVRISP_SCK_PROFILES];
+    uint8_t _sckNext;           // profile replaced next
+
+    // programmer settings, set by remote end
+    AVRISP_parameter_t param;
+
+    int error = 0;
+    bool pmode = 0;
+
+    // word address for reading and writing, set by 'U' command. 32 bits,
+    // the 64K word segment comes from 0x4D
+    int here;
+    int _extAddr;               // segment the target has selected, -1 if not known
+    uint8_t _hostExtAddr;       // segment the host last loaded with 0x4D
+
+    AVRISP_device_t _device;
+    bool _deviceKnown;
+    uint32_t _twdFlash;         // write cycle budgets in us, the polling timeouts
+    uint32_t _twdEeprom;
+    uint32_t _twdErase;
+
+    AVRISPPollMode_t _pollMode;
+    AVRISPPollMode_t _pollModeSet;  // from setPollMode(), restored at program mode entry
+    int _pollAddr;              // byte address data polling reads back, -1 for none
+    uint8_t _pollValue;         // value written there
+    AVRISP_writetime_t _flashTime;
+    AVRISP_writetime_t _eepromTime;
+    AVRISP_writetime_t _eraseTime;
+
+    bool _incremental;
+    bool _erased;               // chip erased since program mode was entered
+    uint8_t _running;           // write cycle not waited for yet: 'C' erase, 'F' flash page, 0 none
+    uint32_t _runningSince;
+    AVRISP_pagecount_t _pages;
+
+    AVRISP_stats_t _stats;
+
+    bool _verify;
+    int _verifyAddr;            // word address of the page waiting for read back, -1 for none
+    int _verifyLen;
+    uint32_t _verifyCrc;        // CRC32 of what was written there
+    AVRISP_verify_t _verified;
+};
+
+#endif //AVRISPENGINE_H
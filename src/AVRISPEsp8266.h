@@ -0,0 +1,151 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+ESP8266 bindings of the STK500 engine interfaces.
+*/
+
+#ifndef AVRISPESP8266_H
+#define AVRISPESP8266_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <ESP8266WiFi.h>
+#include "AVRISPInterfaces.h"
+
+// hardware SPI (HSPI) on GPIO12/13/14
+class AVRISPEsp8266Spi: public AVRISPSpi
+{
+public:
+    void begin(uint32_t freq) override {
+        SPI.begin();
+        SPI.setFrequency(freq);
+        SPI.setHwCs(false);
+    }
+    void end() override { SPI.end(); }
+    void setFrequency(uint32_t freq) override { SPI.setFrequency(freq); }
+    uint8_t transfer(uint8_t data) override { return SPI.transfer(data); }
+    // the core splits it into 64 byte FIFO loads
+    void transferBytes(const uint8_t* out, uint8_t* in, size_t len) override { SPI.transferBytes(out, in, len); }
+};
+
+// most targets on one bus, see addTarget()
+#ifndef AVRISP_MAX_TARGETS
+#define AVRISP_MAX_TARGETS 8
+#endif
+
+#define AVRISP_NO_PIN 0xFF
+
+// any GPIO, see AVRISP_ACTIVE_HIGH_RESET. more targets on the same
+// SCK/MOSI/MISO get their own RESET pin, all of them are driven together.
+// MISO of each target must go through its own buffer (e.g. a 74HC125 gate)
+// whose active low enable pin selects the target that answers: every target
+// in reset drives MISO, wired together unbuffered they fight each other
+// whenever their bits differ. without enable pins the engine never selects
+// one, it waits worst case delays and skips read back
+class AVRISPEsp8266Reset: public AVRISPResetPin, public AVRISPTargetSelect
+{
+public:
+    AVRISPEsp8266Reset(uint8_t pin, bool activehigh): _count(1), _asserted(false), _activehigh(activehigh) {
+        _pins[0] = pin;
+        _enables[0] = AVRISP_NO_PIN;
+    }
+
+    void begin() {
+        for (uint8_t i = 0; i < _count; i++) {
+            begin(i);
+        }
+    }
+    void setReset(bool asserted) override {
+        _asserted = asserted;
+        for (uint8_t i = 0; i < _count; i++) {
+            digitalWrite(_pins[i], asserted == _activehigh);
+        }
+    }
+
+    // another target, returns its index or -1 if there are too many
+    int addTarget(uint8_t reset_pin, uint8_t miso_enable_pin) {
+        if (_count >= AVRISP_MAX_TARGETS) {
+            return -1;
+        }
+        _pins[_count] = reset_pin;
+        _enables[_count] = miso_enable_pin;
+        begin(_count);
+        return _count++;
+    }
+    void setMisoEnable(uint8_t index, uint8_t miso_enable_pin) {
+        if (index < _count) {
+            _enables[index] = miso_enable_pin;
+            begin(index);
+        }
+    }
+
+    uint8_t targets() override { return _count; }
+    bool selectTarget(uint8_t index) override {
+        if (index >= _count) {
+            return false;
+        }
+        for (uint8_t i = 0; i < _count; i++) {
+            if (_enables[i] == AVRISP_NO_PIN) {
+                // only a single target can do without
+                return _count == 1;
+            }
+        }
+        for (uint8_t i = 0; i < _count; i++) {
+            digitalWrite(_enables[i], i != index);
+        }
+        return true;
+    }
+
+protected:
+    void begin(uint8_t i) {
+        pinMode(_pins[i], OUTPUT);
+        digitalWrite(_pins[i], _asserted == _activehigh);
+        if (_enables[i] != AVRISP_NO_PIN) {
+            // the first target answers until another is selected
+            pinMode(_enables[i], OUTPUT);
+            digitalWrite(_enables[i], i != 0);
+        }
+    }
+
+    uint8_t _pins[AVRISP_MAX_TARGETS];
+    uint8_t _enables[AVRISP_MAX_TARGETS];
+    uint8_t _count;
+    bool _asserted;
+    bool _activehigh;
+};
+
+class AVRISPEsp8266Clock: public AVRISPClock
+{
+public:
+    uint32_t millis() override { return ::millis(); }
+    uint32_t micros() override { return ::micros(); }
+    void delay(uint32_t ms) override { ::delay(ms); }
+    void delayMicroseconds(uint32_t us) override { ::delayMicroseconds(us); }
+    void yield() override { ::yield(); }
+};
+
+// raw TCP client, commands are read as they arrive
+class AVRISPClientTransport: public AVRISPTransport
+{
+public:
+    AVRISPClientTransport(WiFiClient& client, uint32_t timeout_ms): _client(client), _timeout(timeout_ms) {}
+
+    int read() override {
+        uint32_t started = ::millis();
+        while (!_client.available()) {
+            if (!_client.connected() || ::millis() - started > _timeout) {
+                return -1;
+            }
+            ::yield();
+        }
+        return _client.read();
+    }
+    bool available() override { return _client.available(); }
+
+protected:
+    WiFiClient& _client;
+    uint32_t _timeout;
+};
+
+#endif //AVRISPESP8266_H
@@ -0,0 +1,244 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Flash images staged in the ESP8266 file system.
+*/
+#include "AVRISPImage.h"
+#include "AVRISPEngine.h"
+
+#define AVRISP_IMAGE_VERSION 1
+
+AVRISPImage::AVRISPImage():
+_writing(false),
+_records(0),
+_offset(0)
+{
+    memset(&_manifest, 0, sizeof(_manifest));
+}
+
+String AVRISPImage::path(const String& name, bool temporary) {
+    String p = AVRISP_IMAGE_DIR;
+    p += name;
+    if (temporary) {
+        p += ".tmp";
+    }
+    return p;
+}
+
+bool AVRISPImage::validName(const String& name) {
+    if (name.length() == 0 || name.length() > AVRISP_IMAGE_NAME) {
+        return false;
+    }
+    for (size_t i = 0; i < name.length(); i++) {
+        char c = name[i];
+        if (!isalnum(c) && c != '-' && c != '_' && c != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AVRISPImage::create(const String& name, const uint8_t signature[3], uint16_t pagesize) {
+    close();
+    if (!validName(name) || pagesize == 0) {
+        return false;
+    }
+    _file = AVRISP_IMAGE_FS.open(path(name, true), "w");
+    if (!_file) {
+        return false;
+    }
+    _name = name;
+    _writing = true;
+    memset(&_manifest, 0, sizeof(_manifest));
+    _manifest.magic = AVRISP_IMAGE_MAGIC;
+    memcpy(_manifest.signature, signature, 3);
+    _manifest.version = AVRISP_IMAGE_VERSION;
+    _manifest.pagesize = pagesize;
+    return true;
+}
+
+bool AVRISPImage::addPage(uint32_t addr, const uint8_t* data, size_t len) {
+    if (!_writing) {
+        return false;
+    }
+    size_t lead = addr % _manifest.pagesize;
+    if (lead + len > _manifest.pagesize) {
+        return false;
+    }
+    size_t i = 0;
+    while (i < len && data[i] == 0xFF) {
+        i++;
+    }
+    if (i == len) {
+        // nothing to program
+        return true;
+    }
+
+    static const uint8_t blank[16] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    uint8_t head[4];
+    uint32_t page = addr - lead;
+    head[0] = page & 0xFF;
+    head[1] = (page >> 8) & 0xFF;
+    head[2] = (page >> 16) & 0xFF;
+    head[3] = (page >> 24) & 0xFF;
+    size_t written = _file.write(head, sizeof(head));
+    _manifest.crc32 = AVRISPEngine::crc32(_manifest.crc32, head, sizeof(head));
+    // the record is always a whole page, pad around the data
+    size_t tail = _manifest.pagesize - lead - len;
+    for (size_t pad = lead; pad; ) {
+        size_t n = pad < sizeof(blank) ? pad : sizeof(blank);
+        written += _file.write(blank, n);
+        _manifest.crc32 = AVRISPEngine::crc32(_manifest.crc32, blank, n);
+        pad -= n;
+    }
+    written += _file.write(data, len);
+    _manifest.crc32 = AVRISPEngine::crc32(_manifest.crc32, data, len);
+    for (size_t pad = tail; pad; ) {
+        size_t n = pad < sizeof(blank) ? pad : sizeof(blank);
+        written += _file.write(blank, n);
+        _manifest.crc32 = AVRISPEngine::crc32(_manifest.crc32, blank, n);
+        pad -= n;
+    }
+    _manifest.pages++;
+    // a short write means the file system is full
+    return written == sizeof(head) + _manifest.pagesize;
+}
+
+bool AVRISPImage::commit() {
+    if (!_writing) {
+        return false;
+    }
+    bool ok = _file.write((const uint8_t *)&_manifest, sizeof(_manifest)) == sizeof(_manifest);
+    _file.close();
+    _writing = false;
+    String tmp = path(_name, true);
+    if (!ok) {
+        AVRISP_IMAGE_FS.remove(tmp);
+        return false;
+    }
+    AVRISP_IMAGE_FS.remove(path(_name));
+    return AVRISP_IMAGE_FS.rename(tmp, path(_name));
+}
+
+bool AVRISPImage::open(const String& name) {
+    close();
+    if (!validName(name)) {
+        return false;
+    }
+    _file = AVRISP_IMAGE_FS.open(path(name), "r");
+    if (!_file) {
+        return false;
+    }
+    size_t size = _file.size();
+    if (size < sizeof(_manifest)
+        || !_file.seek(size - sizeof(_manifest))
+        || _file.read((uint8_t *)&_manifest, sizeof(_manifest)) != sizeof(_manifest)
+        || _manifest.magic != AVRISP_IMAGE_MAGIC
+        || _manifest.version != AVRISP_IMAGE_VERSION
+        || _manifest.pagesize == 0
+        || size - sizeof(_manifest) != (uint32_t)_manifest.pages * (4 + _manifest.pagesize)) {
+        close();
+        return false;
+    }
+    _name = name;
+    _records = size - sizeof(_manifest);
+    _offset = 0;
+    _file.seek(0);
+    return true;
+}
+
+bool AVRISPImage::check() {
+    if (!_file || _writing) {
+        return false;
+    }
+    uint8_t chunk[64];
+    uint32_t crc = 0;
+    _file.seek(0);
+    for (uint32_t x = 0; x < _records; ) {
+        size_t n = _records - x < sizeof(chunk) ? _records - x : sizeof(chunk);
+        if (_file.read(chunk, n) != n) {
+            return false;
+        }
+        crc = AVRISPEngine::crc32(crc, chunk, n);
+        x += n;
+        yield();
+    }
+    _file.seek(0);
+    _offset = 0;
+    return crc == _manifest.crc32;
+}
+
+int AVRISPImage::readPage(uint32_t& addr, uint8_t* page) {
+    if (!_file || _writing) {
+        return -1;
+    }
+    if (_offset >= _records) {
+        return 0;
+    }
+    uint8_t head[4];
+    if (_file.read(head, sizeof(head)) != sizeof(head)
+        || _file.read(page, _manifest.pagesize) != _manifest.pagesize) {
+        return -1;
+    }
+    addr = head[0] | (head[1] << 8) | ((uint32_t)head[2] << 16) | ((uint32_t)head[3] << 24);
+    _offset += sizeof(head) + _manifest.pagesize;
+    return 1;
+}
+
+void AVRISPImage::close() {
+    if (_writing) {
+        // never committed, drop it
+        _file.close();
+        AVRISP_IMAGE_FS.remove(path(_name, true));
+        _writing = false;
+    } else if (_file) {
+        _file.close();
+    }
+    _records = 0;
+    _offset = 0;
+}
+
+bool AVRISPImage::remove(const String& name) {
+    return validName(name) && AVRISP_IMAGE_FS.remove(path(name));
+}
+
+String AVRISPImage::list() {
+    String json = "[";
+    Dir dir = AVRISP_IMAGE_FS.openDir(AVRISP_IMAGE_DIR);
+    while (dir.next()) {
+        // SPIFFS lists full paths, LittleFS names in the directory
+        String name = dir.fileName();
+        if (name.startsWith(AVRISP_IMAGE_DIR)) {
+            name = name.substring(strlen(AVRISP_IMAGE_DIR));
+        }
+        AVRISPImage image;
+        if (!image.open(name)) {
+            // temporary or foreign file
+            continue;
+        }
+        const AVRISP_image_t& m = image.manifest();
+        char sig[7], crc[9];
+        snprintf(sig, sizeof(sig), "%02x%02x%02x", m.signature[0], m.signature[1], m.signature[2]);
+        snprintf(crc, sizeof(crc), "%08x", (unsigned)m.crc32);
+        if (json.length() > 1) {
+            json += ',';
+        }
+        json += "{\"name\":\"";
+        json += name;
+        json += "\",\"signature\":\"";
+        json += sig;
+        json += "\",\"pagesize\":";
+        json += m.pagesize;
+        json += ",\"pages\":";
+        json += m.pages;
+        json += ",\"crc32\":\"";
+        json += crc;
+        json += "\"}";
+    }
+    json += "]";
+    return json;
+}
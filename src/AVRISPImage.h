@@ -0,0 +1,82 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Flash images staged in the ESP8266 file system. An image is stored already
+cut into target pages: one record per non-blank page (byte address, then the
+page), followed by a manifest with the target signature, the page size and a
+CRC32 of the records. Programming from it needs no network and no parsing.
+*/
+
+#ifndef AVRISPIMAGE_H
+#define AVRISPIMAGE_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+// file system holding the images, the example sketch mounts SPIFFS
+#ifndef AVRISP_IMAGE_FS
+#define AVRISP_IMAGE_FS SPIFFS
+#endif
+
+#define AVRISP_IMAGE_DIR   "/img/"
+#define AVRISP_IMAGE_MAGIC 0x49525641UL    // "AVRI"
+#define AVRISP_IMAGE_NAME  20              // longest name, SPIFFS paths are 31 chars
+
+// manifest at the end of an image file
+typedef struct {
+    uint32_t magic;
+    uint8_t signature[3];       // target the image is for, 0 0 0 for any
+    uint8_t version;
+    uint16_t pagesize;
+    uint16_t pages;             // page records in front of the manifest
+    uint32_t crc32;             // CRC32 of the page records
+} AVRISP_image_t;
+
+class AVRISPImage
+{
+public:
+    AVRISPImage();
+    ~AVRISPImage() { close(); }
+
+    // new image, stored under a temporary name until commit()
+    bool create(const String& name, const uint8_t signature[3], uint16_t pagesize);
+    // add len bytes at byte address addr, at most one page starting on a
+    // page boundary. blank pages are not stored
+    bool addPage(uint32_t addr, const uint8_t* data, size_t len);
+    // write the manifest and replace an older image of the same name
+    bool commit();
+
+    // open a stored image and read its manifest
+    bool open(const String& name);
+    // check the records against the manifest CRC, then rewind
+    bool check();
+    // next page into page, which holds pagesize bytes. returns 1, or 0 at
+    // the end, -1 on a read error
+    int readPage(uint32_t& addr, uint8_t* page);
+
+    void close();
+
+    const AVRISP_image_t& manifest() const { return _manifest; }
+
+    // letters, digits, '-', '_' and '.' up to AVRISP_IMAGE_NAME characters
+    static bool validName(const String& name);
+    static bool remove(const String& name);
+    // JSON array of the stored images
+    static String list();
+
+protected:
+    AVRISPImage(const AVRISPImage&);
+    AVRISPImage& operator=(const AVRISPImage&);
+
+    static String path(const String& name, bool temporary = false);
+
+    File _file;
+    String _name;
+    bool _writing;
+    uint32_t _records;          // bytes of page records, reading
+    uint32_t _offset;
+    AVRISP_image_t _manifest;
+};
+
+#endif //AVRISPIMAGE_H
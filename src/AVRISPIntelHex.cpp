@@ -0,0 +1,199 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Incremental Intel HEX decoder.
+*/
+#include "AVRISPIntelHex.h"
+#include <string.h>
+
+#define HEX_DATA        0x00
+#define HEX_EOF         0x01
+#define HEX_EXT_SEGMENT 0x02
+#define HEX_START_SEG   0x03
+#define HEX_EXT_LINEAR  0x04
+#define HEX_START_LIN   0x05
+
+static int hexValue(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+AVRISPIntelHex::AVRISPIntelHex(uint8_t* page, size_t pagesize, THandlerFunction handler):
+_page(page),
+_pagesize(pagesize),
+_handler(handler),
+_pageAddr(0),
+_pageUsed(0),
+_pageDirty(false),
+_emitted(false),
+_lastEmitted(0),
+_base(0),
+_recLen(0),
+_recNeed(0),
+_inRecord(false),
+_highNibble(true),
+_nibble(0),
+_sum(0),
+_eof(false),
+_records(0),
+_status(AVRISP_HEX_OK)
+{
+}
+
+AVRISPHexStatus_t AVRISPIntelHex::feed(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len && _status == AVRISP_HEX_OK; i++) {
+        uint8_t c = data[i];
+        if (!_inRecord) {
+            if (c == '\r' || c == '\n' || c == ' ' || c == '\t') {
+                continue;
+            }
+            if (c != ':') {
+                _status = AVRISP_HEX_BAD_CHAR;
+            } else if (_eof) {
+                _status = AVRISP_HEX_AFTER_EOF;
+            } else {
+                _inRecord = true;
+                _highNibble = true;
+                _recLen = 0;
+                _recNeed = 1;
+                _sum = 0;
+            }
+            continue;
+        }
+
+        int v = hexValue(c);
+        if (v < 0) {
+            _status = AVRISP_HEX_BAD_CHAR;
+            break;
+        }
+        if (_highNibble) {
+            _nibble = v;
+            _highNibble = false;
+            continue;
+        }
+        _highNibble = true;
+        uint8_t b = (_nibble << 4) | v;
+        _rec[_recLen++] = b;
+        _sum += b;
+        if (_recLen == 1) {
+            // count + address + type + data + checksum
+            _recNeed = 5 + b;
+        }
+        if (_recLen == _recNeed) {
+            _inRecord = false;
+            if (_sum != 0) {
+                _status = AVRISP_HEX_BAD_CHECKSUM;
+            } else {
+                _records++;
+                _status = _record();
+            }
+        }
+    }
+    return _status;
+}
+
+AVRISPHexStatus_t AVRISPIntelHex::finish() {
+    if (_status != AVRISP_HEX_OK) {
+        return _status;
+    }
+    if (!_eof) {
+        _status = AVRISP_HEX_TRUNCATED;
+    }
+    return _status;
+}
+
+AVRISPHexStatus_t AVRISPIntelHex::_record() {
+    uint8_t count = _rec[0];
+    uint16_t offset = (_rec[1] << 8) | _rec[2];
+    uint8_t type = _rec[3];
+    const uint8_t* data = &_rec[4];
+
+    switch (type) {
+    case HEX_DATA:
+        return _data(_base + offset, data, count);
+
+    case HEX_EOF:
+        _eof = true;
+        if (!_flushPage()) {
+            return AVRISP_HEX_ABORTED;
+        }
+        return AVRISP_HEX_OK;
+
+    case HEX_EXT_SEGMENT:
+        if (count != 2) {
+            return AVRISP_HEX_BAD_RECORD;
+        }
+        _base = (uint32_t)((data[0] << 8) | data[1]) << 4;
+        return AVRISP_HEX_OK;
+
+    case HEX_EXT_LINEAR:
+        if (count != 2) {
+            return AVRISP_HEX_BAD_RECORD;
+        }
+        _base = (uint32_t)((data[0] << 8) | data[1]) << 16;
+        return AVRISP_HEX_OK;
+
+    case HEX_START_SEG:
+    case HEX_START_LIN:
+        // entry point, meaningless for an AVR
+        return AVRISP_HEX_OK;
+
+    default:
+        return AVRISP_HEX_BAD_RECORD;
+    }
+}
+
+AVRISPHexStatus_t AVRISPIntelHex::_data(uint32_t addr, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++, addr++) {
+        uint32_t pageAddr = addr - (addr % _pagesize);
+        if (!_pageDirty || pageAddr != _pageAddr) {
+            if (!_flushPage()) {
+                return AVRISP_HEX_ABORTED;
+            }
+            if (_emitted && pageAddr <= _lastEmitted) {
+                // records must be in ascending page order, rewriting a page
+                // that was already programmed would lose its earlier data
+                return AVRISP_HEX_BAD_ORDER;
+            }
+            _pageAddr = pageAddr;
+            _pageUsed = 0;
+            _pageDirty = true;
+            memset(_page, 0xFF, _pagesize);
+        }
+        size_t off = addr - _pageAddr;
+        _page[off] = data[i];
+        if (off + 1 > _pageUsed) {
+            _pageUsed = off + 1;
+        }
+    }
+    return AVRISP_HEX_OK;
+}
+
+bool AVRISPIntelHex::_flushPage() {
+    if (!_pageDirty) {
+        return true;
+    }
+    _pageDirty = false;
+    _emitted = true;
+    _lastEmitted = _pageAddr;
+    // whole words only
+    size_t len = (_pageUsed + 1) & ~1;
+    return _handler(_pageAddr, _page, len);
+}
+
+const char* AVRISPIntelHex::statusString(AVRISPHexStatus_t status) {
+    switch (status) {
+    case AVRISP_HEX_OK:           return "ok";
+    case AVRISP_HEX_BAD_CHAR:     return "bad character";
+    case AVRISP_HEX_BAD_CHECKSUM: return "bad checksum";
+    case AVRISP_HEX_BAD_RECORD:   return "bad record";
+    case AVRISP_HEX_BAD_ORDER:    return "records out of order";
+    case AVRISP_HEX_AFTER_EOF:    return "data after end of file";
+    case AVRISP_HEX_TRUNCATED:    return "truncated";
+    case AVRISP_HEX_ABORTED:      return "aborted";
+    }
+    return "unknown";
+}
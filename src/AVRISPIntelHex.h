@@ -0,0 +1,84 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Incremental Intel HEX decoder. Text is fed in chunks of any size as it comes
+off the socket, records are checksummed and their data is collected into a
+caller supplied page buffer, which is handed out one page aligned run at a
+time.
+*/
+
+#ifndef AVRISPINTELHEX_H
+#define AVRISPINTELHEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+// longest data field of a record
+#define AVRISP_HEX_MAX_DATA 255
+
+// decoder status
+typedef enum {
+    AVRISP_HEX_OK = 0,
+    AVRISP_HEX_BAD_CHAR,        // not a hex digit, or text outside a record
+    AVRISP_HEX_BAD_CHECKSUM,    // record checksum mismatch
+    AVRISP_HEX_BAD_RECORD,      // unknown record type or malformed record
+    AVRISP_HEX_BAD_ORDER,       // data for a page that was already handed out
+    AVRISP_HEX_AFTER_EOF,       // record following the end of file record
+    AVRISP_HEX_TRUNCATED,       // input ended before the end of file record
+    AVRISP_HEX_ABORTED          // page handler returned false
+} AVRISPHexStatus_t;
+
+class AVRISPIntelHex
+{
+public:
+    // called with a page aligned byte address, the page buffer and the number
+    // of bytes in use (always even, gaps are 0xFF). return false to abort
+    typedef std::function<bool(uint32_t addr, const uint8_t* data, size_t len)> THandlerFunction;
+
+    AVRISPIntelHex(uint8_t* page, size_t pagesize, THandlerFunction handler);
+
+    // decode the next chunk of text, returns the (sticky) status
+    AVRISPHexStatus_t feed(const uint8_t* data, size_t len);
+
+    // hand out the last page, fails if the end of file record was not seen
+    AVRISPHexStatus_t finish();
+
+    bool eof() const { return _eof; }
+    uint32_t records() const { return _records; }
+
+    static const char* statusString(AVRISPHexStatus_t status);
+
+protected:
+    AVRISPHexStatus_t _record();
+    AVRISPHexStatus_t _data(uint32_t addr, const uint8_t* data, size_t len);
+    bool _flushPage();
+
+    uint8_t* _page;
+    size_t _pagesize;
+    THandlerFunction _handler;
+
+    uint32_t _pageAddr;         // byte address of the page being collected
+    size_t _pageUsed;           // bytes of the page touched so far
+    bool _pageDirty;
+    bool _emitted;              // a page was handed out already
+    uint32_t _lastEmitted;      // address of the last page handed out
+
+    uint32_t _base;             // from extended segment / linear address records
+
+    // record being decoded: count, address (2), type, data, checksum
+    uint8_t _rec[4 + AVRISP_HEX_MAX_DATA + 1];
+    size_t _recLen;
+    size_t _recNeed;
+    bool _inRecord;
+    bool _highNibble;
+    uint8_t _nibble;
+    uint8_t _sum;
+
+    bool _eof;
+    uint32_t _records;
+    AVRISPHexStatus_t _status;
+};
+
+#endif //AVRISPINTELHEX_H
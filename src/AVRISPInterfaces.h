@@ -0,0 +1,95 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Hardware and transport interfaces of the STK500 engine. The engine only talks
+to these, so it builds without the Arduino core: the ESP8266 bindings are in
+AVRISPEsp8266.h, other platforms (or mocks) implement the same classes.
+*/
+
+#ifndef AVRISPINTERFACES_H
+#define AVRISPINTERFACES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SPI bus to the target
+class AVRISPSpi
+{
+public:
+    virtual ~AVRISPSpi() {}
+    virtual void begin(uint32_t freq) = 0;
+    virtual void end() = 0;
+    virtual void setFrequency(uint32_t freq) = 0;
+    virtual uint8_t transfer(uint8_t data) = 0;
+    // full duplex burst, in may be out or nullptr
+    virtual void transferBytes(const uint8_t* out, uint8_t* in, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            uint8_t b = transfer(out[i]);
+            if (in) in[i] = b;
+        }
+    }
+};
+
+// RESET line of the target
+class AVRISPResetPin
+{
+public:
+    virtual ~AVRISPResetPin() {}
+    // true holds the target in reset, the pin polarity is up to the implementation
+    virtual void setReset(bool asserted) = 0;
+};
+
+// several targets sharing SCK/MOSI/MISO, with their RESET lines driven
+// together: they all take the same instructions, and the one selected here
+// answers on MISO
+class AVRISPTargetSelect
+{
+public:
+    virtual ~AVRISPTargetSelect() {}
+    virtual uint8_t targets() = 0;
+    // connect MISO to target index, false if MISO can not be switched
+    virtual bool selectTarget(uint8_t index) = 0;
+};
+
+// time keeping
+class AVRISPClock
+{
+public:
+    virtual ~AVRISPClock() {}
+    virtual uint32_t millis() = 0;
+    virtual uint32_t micros() = 0;
+    virtual void delay(uint32_t ms) = 0;
+    virtual void delayMicroseconds(uint32_t us) = 0;
+    // let the rest of the system run during long operations
+    virtual void yield() = 0;
+};
+
+// byte stream the STK500 commands arrive on. replies are collected by the
+// engine and sent by whoever owns the transport
+class AVRISPTransport
+{
+public:
+    virtual ~AVRISPTransport() {}
+    // next command byte, -1 if none arrives
+    virtual int read() = 0;
+    // true while more command bytes are pending
+    virtual bool available() = 0;
+};
+
+// commands already in memory, e.g. a request body
+class AVRISPBufferTransport: public AVRISPTransport
+{
+public:
+    AVRISPBufferTransport(const uint8_t* data, size_t len): _data(data), _len(len), _index(0) {}
+
+    int read() override { return _index < _len ? _data[_index++] : -1; }
+    bool available() override { return _index < _len; }
+
+protected:
+    const uint8_t* _data;
+    size_t _len;
+    size_t _index;
+};
+
+#endif //AVRISPINTERFACES_H
@@ -0,0 +1,312 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Simulated AVR target behind the SPI and RESET interfaces.
+*/
+#include "AVRISPSimTarget.h"
+#include <stdlib.h>
+#include <string.h>
+
+AVRISPSimTarget::AVRISPSimTarget(AVRISPSimClock& clock, size_t flash_size, size_t page_size,
+                                 size_t eeprom_size, const uint8_t signature[3], size_t eeprom_page_size):
+_clock(clock),
+_flash(nullptr),
+_eeprom(nullptr),
+_page(nullptr),
+_eepromPage(nullptr),
+_flashSize(flash_size),
+_pageSize(page_size),
+_eepromSize(eeprom_size),
+_eepromPageSize(eeprom_page_size),
+_lock(0xFF),
+_extAddr(0),
+_eepromLoaded(0),
+_twdFlash(AVRISP_SIM_TWD_FLASH),
+_twdEeprom(AVRISP_SIM_TWD_EEPROM),
+_twdErase(AVRISP_SIM_TWD_ERASE),
+_twdFuse(AVRISP_SIM_TWD_FUSE),
+_bitNs(1000),
+_freq(1000000),
+_maxFreq(0),
+_spiOn(false),
+_reset(false),
+_programming(false),
+_index(0),
+_busyUntil(0),
+_instructions(0),
+_flashPages(0),
+_eepromWrites(0),
+_erases(0),
+_busyViolations(0),
+_rejected(0)
+{
+    memcpy(_signature, signature, 3);
+    // factory fuses of an ATmega328P
+    _fuses[0] = 0x62;
+    _fuses[1] = 0xD9;
+    _fuses[2] = 0xFF;
+    _flash = (uint8_t*) malloc(flash_size);
+    _eeprom = (uint8_t*) malloc(eeprom_size);
+    _page = (uint8_t*) malloc(page_size);
+    _eepromPage = (uint8_t*) malloc(eeprom_page_size);
+    if (!ok()) {
+        return;
+    }
+    memset(_flash, 0xFF, flash_size);
+    memset(_eeprom, 0xFF, eeprom_size);
+    memset(_page, 0xFF, page_size);
+    memset(_eepromPage, 0xFF, eeprom_page_size);
+}
+
+AVRISPSimTarget::~AVRISPSimTarget() {
+    free(_flash);
+    free(_eeprom);
+    free(_page);
+    free(_eepromPage);
+}
+
+void AVRISPSimTarget::setWriteTimes(uint32_t flash_us, uint32_t eeprom_us, uint32_t erase_us, uint32_t fuse_us) {
+    _twdFlash = flash_us;
+    _twdEeprom = eeprom_us;
+    _twdErase = erase_us;
+    _twdFuse = fuse_us;
+}
+
+void AVRISPSimTarget::begin(uint32_t freq) {
+    _spiOn = true;
+    setFrequency(freq);
+}
+
+void AVRISPSimTarget::end() {
+    _spiOn = false;
+}
+
+void AVRISPSimTarget::setFrequency(uint32_t freq) {
+    _freq = freq;
+    _bitNs = freq ? 1000000000UL / freq : 1000;
+}
+
+void AVRISPSimTarget::setReset(bool asserted) {
+    if (asserted != _reset) {
+        // any edge on RESET starts a new instruction frame
+        _index = 0;
+        _extAddr = 0;
+    }
+    if (!asserted) {
+        // released, the target runs its program again
+        _programming = false;
+    }
+    _reset = asserted;
+}
+
+uint8_t AVRISPSimTarget::transfer(uint8_t data) {
+    _clock.advanceNs((uint64_t)_bitNs * 8);
+    return shift(data);
+}
+
+uint8_t AVRISPSimTarget::shift(uint8_t data) {
+    if (!_spiOn || !_reset || (_maxFreq && _freq > _maxFreq)) {
+        return 0xFF;
+    }
+    _cmd[_index] = data;
+    // the target echoes the previous byte, the 4th byte clocks out the result
+    if (_index < 3) {
+        uint8_t out = _index ? _cmd[_index - 1] : 0x00;
+        _index++;
+        return out;
+    }
+    _index = 0;
+    _instructions++;
+    return execute();
+}
+
+void AVRISPSimTarget::startWrite(uint32_t us) {
+    _busyUntil = _clock.nanos() + (uint64_t)us * 1000;
+}
+
+uint8_t AVRISPSimTarget::execute() {
+    uint8_t a = _cmd[0], b = _cmd[1], c = _cmd[2], d = _cmd[3];
+
+    if (!_programming) {
+        if (a == 0xAC && b == 0x53) {
+            _programming = true;
+            return d;
+        }
+        _rejected++;
+        return 0xFF;
+    }
+
+    // RDY/BSY is the only instruction a busy part answers
+    if (a == 0xF0) {
+        return busy() ? 0x01 : 0x00;
+    }
+    if (busy()) {
+        // reads during a write give 0xFF, which is what data polling expects
+        if (a != 0x20 && a != 0x28 && a != 0xA0) {
+            _busyViolations++;
+        }
+        return 0xFF;
+    }
+
+    uint32_t word = ((uint32_t)_extAddr << 16) | ((uint32_t)b << 8) | c;
+    uint32_t eeaddr = ((uint32_t)b << 8) | c;
+
+    switch (a) {
+    case 0xAC:
+        if (b == 0x53) {
+            return d;
+        }
+        if ((b & 0xE0) == 0x80) {
+            memset(_flash, 0xFF, _flashSize);
+            memset(_eeprom, 0xFF, _eepromSize);
+            _lock = 0xFF;
+            _erases++;
+            startWrite(_twdErase);
+            return d;
+        }
+        if (b == 0xA0) { _fuses[0] = d; startWrite(_twdFuse); return d; }
+        if (b == 0xA8) { _fuses[1] = d; startWrite(_twdFuse); return d; }
+        if (b == 0xA4) { _fuses[2] = d; startWrite(_twdFuse); return d; }
+        // lock bits only go from 1 to 0 until the next chip erase
+        if (b == 0xE0) { _lock &= d; startWrite(_twdFuse); return d; }
+        break;
+
+    case 0x40:
+    case 0x48: {
+        size_t offset = ((word * 2) + (a == 0x48)) % _pageSize;
+        _page[offset] = d;
+        return d;
+    }
+
+    case 0x4C: {
+        uint32_t addr = (word * 2) & ~(uint32_t)(_pageSize - 1);
+        if (addr + _pageSize <= _flashSize) {
+            // programming only clears bits, the page has to be erased first
+            for (size_t i = 0; i < _pageSize; i++) {
+                _flash[addr + i] &= _page[i];
+            }
+        }
+        memset(_page, 0xFF, _pageSize);
+        _flashPages++;
+        startWrite(_twdFlash);
+        return d;
+    }
+
+    case 0x4D:
+        _extAddr = c;
+        return d;
+
+    case 0x20:
+    case 0x28: {
+        uint32_t addr = word * 2 + (a == 0x28);
+        return addr < _flashSize ? _flash[addr] : 0xFF;
+    }
+
+    case 0xC0:
+        if (eeaddr < _eepromSize) {
+            _eeprom[eeaddr] = d;
+        }
+        _eepromWrites++;
+        startWrite(_twdEeprom);
+        return d;
+
+    case 0xA0:
+        return eeaddr < _eepromSize ? _eeprom[eeaddr] : 0xFF;
+
+    case 0xC1:
+        _eepromPage[c % _eepromPageSize] = d;
+        _eepromLoaded |= 1UL << (c % _eepromPageSize);
+        return d;
+
+    case 0xC2: {
+        uint32_t addr = eeaddr & ~(uint32_t)(_eepromPageSize - 1);
+        // bytes that were not loaded keep their value
+        for (size_t i = 0; i < _eepromPageSize && addr + i < _eepromSize; i++) {
+            if (_eepromLoaded & (1UL << i)) {
+                _eeprom[addr + i] = _eepromPage[i];
+            }
+        }
+        _eepromLoaded = 0;
+        _eepromWrites++;
+        startWrite(_twdEeprom);
+        return d;
+    }
+
+    case 0x30:
+        return c < 3 ? _signature[c] : 0xFF;
+
+    case 0x38:
+        // oscillator calibration byte
+        return 0x80;
+
+    case 0x50:
+        if (b == 0x00) return _fuses[0];
+        if (b == 0x08) return _fuses[2];
+        break;
+
+    case 0x58:
+        if (b == 0x00) return _lock;
+        if (b == 0x08) return _fuses[1];
+        break;
+    }
+    _rejected++;
+    return 0xFF;
+}
+
+bool AVRISPSimGang::add(AVRISPSimTarget& target) {
+    if (_count >= AVRISP_SIM_GANG) {
+        return false;
+    }
+    _targets[_count++] = &target;
+    return true;
+}
+
+void AVRISPSimGang::begin(uint32_t freq) {
+    for (uint8_t i = 0; i < _count; i++) {
+        _targets[i]->begin(freq);
+    }
+    setFrequency(freq);
+}
+
+void AVRISPSimGang::end() {
+    for (uint8_t i = 0; i < _count; i++) {
+        _targets[i]->end();
+    }
+}
+
+void AVRISPSimGang::setFrequency(uint32_t freq) {
+    for (uint8_t i = 0; i < _count; i++) {
+        _targets[i]->setFrequency(freq);
+    }
+    _bitNs = freq ? 1000000000UL / freq : 1000;
+}
+
+uint8_t AVRISPSimGang::transfer(uint8_t data) {
+    // the targets shift in parallel, the bus time passes once
+    _clock.advanceNs((uint64_t)_bitNs * 8);
+    uint8_t out = 0xFF;
+    for (uint8_t i = 0; i < _count; i++) {
+        uint8_t b = _targets[i]->shift(data);
+        if (_sharedMiso) {
+            out &= b;
+        } else if (i == _selected) {
+            out = b;
+        }
+    }
+    return out;
+}
+
+void AVRISPSimGang::setReset(bool asserted) {
+    for (uint8_t i = 0; i < _count; i++) {
+        _targets[i]->setReset(asserted);
+    }
+}
+
+bool AVRISPSimGang::selectTarget(uint8_t index) {
+    if (index >= _count || (_sharedMiso && _count > 1)) {
+        return false;
+    }
+    _selected = index;
+    return true;
+}
@@ -0,0 +1,188 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Simulated AVR target for running the STK500 engine without hardware. It
+implements the SPI and RESET interfaces and decodes the 4-byte serial
+programming instructions like a real part: program enable, flash page
+load/write, flash/EEPROM/signature/fuse/lock read and write, chip erase,
+load extended address and the RDY/BSY poll. Writes keep the target busy for
+the configured tWD times, measured on an AVRISPSimClock which also advances
+by the SPI transfer time of every byte, so a run gives the time the same
+flash would take on the wire.
+
+    AVRISPSimClock clock;
+    AVRISPSimTarget target(clock, 32768, 128, 1024, sig_atmega328p);
+    AVRISPEngine engine(target, target, clock, arena, 1000000);
+    ... feed avrdude's byte stream through an AVRISPBufferTransport ...
+    target.flash() now holds the image, clock.micros() the time it took
+*/
+
+#ifndef AVRISPSIMTARGET_H
+#define AVRISPSIMTARGET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "AVRISPInterfaces.h"
+
+// default write times of an ATmega328P, in us
+#define AVRISP_SIM_TWD_FLASH  4500
+#define AVRISP_SIM_TWD_EEPROM 3600
+#define AVRISP_SIM_TWD_ERASE  9000
+#define AVRISP_SIM_TWD_FUSE   4500
+
+#define AVRISP_SIM_GANG 8
+
+// virtual time, only moves when the engine waits or the target is clocked
+class AVRISPSimClock: public AVRISPClock
+{
+public:
+    AVRISPSimClock(): _ns(0) {}
+
+    uint32_t millis() override { return _ns / 1000000; }
+    uint32_t micros() override { return _ns / 1000; }
+    void delay(uint32_t ms) override { _ns += (uint64_t)ms * 1000000; }
+    void delayMicroseconds(uint32_t us) override { _ns += (uint64_t)us * 1000; }
+    void yield() override {}
+
+    void advanceNs(uint64_t ns) { _ns += ns; }
+    uint64_t nanos() const { return _ns; }
+
+protected:
+    uint64_t _ns;
+};
+
+class AVRISPSimTarget: public AVRISPSpi, public AVRISPResetPin
+{
+public:
+    // sizes in bytes, page_size is the flash page, eeprom_page_size at most 32
+    AVRISPSimTarget(AVRISPSimClock& clock, size_t flash_size, size_t page_size,
+                    size_t eeprom_size, const uint8_t signature[3], size_t eeprom_page_size = 4);
+    ~AVRISPSimTarget();
+
+    // false if the memories could not be allocated
+    bool ok() const { return _flash && _eeprom && _page && _eepromPage; }
+
+    // fastest SCK the part follows, f_cpu / 4 on a real AVR. above it the
+    // target ignores the bus and MISO reads 0xFF. 0 for no limit
+    void setMaxFrequency(uint32_t hz) { _maxFreq = hz; }
+
+    // self-timed write cycles in us
+    void setWriteTimes(uint32_t flash_us, uint32_t eeprom_us, uint32_t erase_us, uint32_t fuse_us);
+
+    // AVRISPSpi
+    void begin(uint32_t freq) override;
+    void end() override;
+    void setFrequency(uint32_t freq) override;
+    uint8_t transfer(uint8_t data) override;
+    // one byte in and out without advancing the clock, for AVRISPSimGang
+    uint8_t shift(uint8_t data);
+
+    // AVRISPResetPin
+    void setReset(bool asserted) override;
+
+    // target memories, erased to 0xFF at construction
+    uint8_t* flash() { return _flash; }
+    uint8_t* eeprom() { return _eeprom; }
+    size_t flashSize() const { return _flashSize; }
+    size_t eepromSize() const { return _eepromSize; }
+    uint8_t fuse(int n) const { return _fuses[n]; }   // 0 low, 1 high, 2 extended
+    uint8_t lock() const { return _lock; }
+
+    bool programming() const { return _programming; }
+    bool busy() const { return _clock.nanos() < _busyUntil; }
+
+    // counters since construction
+    uint32_t instructions() const { return _instructions; }
+    uint32_t flashPages() const { return _flashPages; }
+    uint32_t eepromWrites() const { return _eepromWrites; }
+    uint32_t erases() const { return _erases; }
+    // instructions that arrived while a write cycle was still running,
+    // a real part would have ignored or corrupted them
+    uint32_t busyViolations() const { return _busyViolations; }
+    // instructions not understood, or sent outside programming mode
+    uint32_t rejected() const { return _rejected; }
+
+protected:
+    AVRISPSimTarget(const AVRISPSimTarget&);
+    AVRISPSimTarget& operator=(const AVRISPSimTarget&);
+
+    uint8_t execute();          // run the instruction in _cmd, returns the 4th output byte
+    void startWrite(uint32_t us);
+
+    AVRISPSimClock& _clock;
+    uint8_t* _flash;
+    uint8_t* _eeprom;
+    uint8_t* _page;             // flash page buffer
+    uint8_t* _eepromPage;       // EEPROM page buffer
+    size_t _flashSize;
+    size_t _pageSize;
+    size_t _eepromSize;
+    size_t _eepromPageSize;
+    uint8_t _signature[3];
+    uint8_t _fuses[3];
+    uint8_t _lock;
+    uint8_t _extAddr;
+    uint32_t _eepromLoaded;     // bytes of the EEPROM page buffer loaded since the last write
+
+    uint32_t _twdFlash;
+    uint32_t _twdEeprom;
+    uint32_t _twdErase;
+    uint32_t _twdFuse;
+
+    uint32_t _bitNs;            // SPI clock period
+    uint32_t _freq;
+    uint32_t _maxFreq;
+    bool _spiOn;
+    bool _reset;
+    bool _programming;
+    uint8_t _cmd[4];
+    uint8_t _index;             // byte of the current instruction
+    uint64_t _busyUntil;
+
+    uint32_t _instructions;
+    uint32_t _flashPages;
+    uint32_t _eepromWrites;
+    uint32_t _erases;
+    uint32_t _busyViolations;
+    uint32_t _rejected;
+};
+
+// targets sharing the bus and RESET of one programmer, for gang programming
+// with AVRISPEngine::setTargets(). a byte clocks all of them at once, MISO
+// comes from the selected one, or from all of them with setSharedMiso()
+class AVRISPSimGang: public AVRISPSpi, public AVRISPResetPin, public AVRISPTargetSelect
+{
+public:
+    AVRISPSimGang(AVRISPSimClock& clock): _clock(clock), _count(0), _selected(0), _bitNs(1000), _sharedMiso(false) {}
+
+    // up to AVRISP_SIM_GANG targets, false if full
+    bool add(AVRISPSimTarget& target);
+
+    // MISO wired together without buffers: no target can be selected and a
+    // 0 from any of them pulls the bit low
+    void setSharedMiso(bool shared) { _sharedMiso = shared; }
+
+    // AVRISPSpi
+    void begin(uint32_t freq) override;
+    void end() override;
+    void setFrequency(uint32_t freq) override;
+    uint8_t transfer(uint8_t data) override;
+
+    // AVRISPResetPin
+    void setReset(bool asserted) override;
+
+    // AVRISPTargetSelect
+    uint8_t targets() override { return _count; }
+    bool selectTarget(uint8_t index) override;
+
+protected:
+    AVRISPSimClock& _clock;
+    AVRISPSimTarget* _targets[AVRISP_SIM_GANG];
+    uint8_t _count;
+    uint8_t _selected;
+    uint32_t _bitNs;
+    bool _sharedMiso;
+};
+
+#endif //AVRISPSIMTARGET_H
@@ -0,0 +1,67 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Telemetry counters for /stats. Everything is fixed size and updated with a
+few additions on the hot path: a histogram is one counter per power of two
+microseconds, so it needs no allocation and no sorting.
+*/
+
+#ifndef AVRISPSTATS_H
+#define AVRISPSTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// bucket n counts durations of 2^n to 2^(n+1)-1 us, the last one all longer
+#define AVRISP_HIST_BUCKETS 16
+
+// STK500 commands counted one by one, Cmnd_STK_GET_SYNC (0x30) and up
+#define AVRISP_STK_FIRST    0x30
+#define AVRISP_STK_COMMANDS 0x50
+
+class AVRISPHistogram
+{
+public:
+    void clear() { memset(this, 0, sizeof(*this)); }
+
+    void add(uint32_t us) {
+        int n = us ? 31 - __builtin_clz(us) : 0;
+        if (n >= AVRISP_HIST_BUCKETS) {
+            n = AVRISP_HIST_BUCKETS - 1;
+        }
+        _buckets[n]++;
+        _count++;
+        _total += us;
+        if (us > _max) {
+            _max = us;
+        }
+    }
+
+    uint32_t count() const { return _count; }
+    uint32_t total() const { return _total; }
+    uint32_t max() const { return _max; }
+    uint32_t average() const { return _count ? _total / _count : 0; }
+    uint32_t bucket(int n) const { return _buckets[n]; }
+
+protected:
+    uint32_t _count;
+    uint32_t _total;            // us, wraps after 71 minutes of samples
+    uint32_t _max;
+    uint32_t _buckets[AVRISP_HIST_BUCKETS];
+};
+
+// counters of the STK500 engine
+typedef struct {
+    uint32_t commands[AVRISP_STK_COMMANDS];     // by command byte
+    uint32_t unknown;           // command bytes outside that range
+    uint32_t flashBytes;        // written to the flash
+    uint32_t eepromBytes;       // written to the EEPROM
+    uint32_t verifiedBytes;     // read back and compared, per target
+    AVRISPHistogram command;    // time per STK500 command
+    AVRISPHistogram spi;        // time per SPI burst or single instruction
+    AVRISPHistogram wait;       // time waiting for a write cycle
+} AVRISP_stats_t;
+
+#endif //AVRISPSTATS_H
@@ -0,0 +1,243 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Minimal single client WebSocket server for the STK500 stream.
+*/
+#include "AVRISPWebSocket.h"
+#include <Arduino.h>
+#include <Hash.h>
+#include <base64.h>
+
+#define WS_OP_CONTINUATION  0x0
+#define WS_OP_TEXT          0x1
+#define WS_OP_BINARY        0x2
+#define WS_OP_CLOSE         0x8
+#define WS_OP_PING          0x9
+#define WS_OP_PONG          0xA
+
+#define WS_CLOSE_NORMAL         1000
+#define WS_CLOSE_PROTOCOL       1002
+#define WS_CLOSE_UNSUPPORTED    1003
+#define WS_CLOSE_TOO_BIG        1009
+
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+AVRISPWebSocket::AVRISPWebSocket(int port):
+_server(port),
+_open(false)
+{
+}
+
+void AVRISPWebSocket::begin() {
+    _server.begin();
+    _server.setNoDelay(true);
+}
+
+int AVRISPWebSocket::poll(uint8_t* buf, size_t size) {
+    if (!_client.connected()) {
+        if (_open) {
+            // dropped without a close frame
+            _client.stop();
+            _open = false;
+            return -1;
+        }
+        if (!_server.hasClient()) {
+            return 0;
+        }
+        _client = _server.available();
+        _client.setNoDelay(true);
+    }
+    // one client at a time
+    while (_server.hasClient()) _server.available().stop();
+
+    if (!_client.available()) {
+        return 0;
+    }
+    if (!_open) {
+        if (!_handshake()) {
+            _client.stop();
+        }
+        return 0;
+    }
+    return _readMessage(buf, size);
+}
+
+bool AVRISPWebSocket::_handshake() {
+    String line = _client.readStringUntil('\n');
+    if (!line.startsWith("GET ")) {
+        return false;
+    }
+    String key;
+    while (true) {
+        line = _client.readStringUntil('\n');
+        line.trim();
+        if (line.length() == 0) {
+            break;
+        }
+        int div = line.indexOf(':');
+        if (div == -1) {
+            return false;
+        }
+        String name = line.substring(0, div);
+        name.toLowerCase();
+        if (name == "sec-websocket-key") {
+            key = line.substring(div + 1);
+            key.trim();
+        }
+    }
+    if (key.length() == 0) {
+        _client.print(F("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n"));
+        return false;
+    }
+
+    key += WS_GUID;
+    uint8_t hash[20];
+    sha1((const uint8_t*)key.c_str(), key.length(), hash);
+    String response = F("HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: ");
+    response += base64::encode(hash, 20, false);
+    response += F("\r\n\r\n");
+    _client.write((const uint8_t*)response.c_str(), response.length());
+    _open = true;
+    return true;
+}
+
+int AVRISPWebSocket::_readMessage(uint8_t* buf, size_t size) {
+    size_t len = 0;
+    bool inMessage = false;
+    while (true) {
+        uint8_t hdr[2];
+        if (!_readExact(hdr, 2)) {
+            return _close(WS_CLOSE_PROTOCOL);
+        }
+        bool fin = hdr[0] & 0x80;
+        uint8_t opcode = hdr[0] & 0x0F;
+        uint32_t plen = hdr[1] & 0x7F;
+        // client frames are always masked
+        if (!(hdr[1] & 0x80)) {
+            return _close(WS_CLOSE_PROTOCOL);
+        }
+        if (plen == 126) {
+            uint8_t ext[2];
+            if (!_readExact(ext, 2)) {
+                return _close(WS_CLOSE_PROTOCOL);
+            }
+            plen = (ext[0] << 8) | ext[1];
+        } else if (plen == 127) {
+            uint8_t ext[8];
+            if (!_readExact(ext, 8)) {
+                return _close(WS_CLOSE_PROTOCOL);
+            }
+            if (ext[0] | ext[1] | ext[2] | ext[3]) {
+                return _close(WS_CLOSE_TOO_BIG);
+            }
+            plen = ((uint32_t)ext[4] << 24) | ((uint32_t)ext[5] << 16) | (ext[6] << 8) | ext[7];
+        }
+        uint8_t mask[4];
+        if (!_readExact(mask, 4)) {
+            return _close(WS_CLOSE_PROTOCOL);
+        }
+
+        if (opcode & 0x8) {
+            // control frames may come between the fragments of a message
+            uint8_t ctl[125];
+            if (plen > sizeof(ctl) || !fin || !_readExact(ctl, plen)) {
+                return _close(WS_CLOSE_PROTOCOL);
+            }
+            for (uint32_t i = 0; i < plen; i++) {
+                ctl[i] ^= mask[i & 3];
+            }
+            if (opcode == WS_OP_CLOSE) {
+                return _close(WS_CLOSE_NORMAL);
+            }
+            if (opcode == WS_OP_PING) {
+                _sendControl(WS_OP_PONG, ctl, plen);
+            }
+            if (!inMessage) {
+                return 0;
+            }
+            continue;
+        }
+
+        if (opcode == WS_OP_TEXT) {
+            return _close(WS_CLOSE_UNSUPPORTED);
+        }
+        if ((opcode == WS_OP_CONTINUATION) != inMessage) {
+            return _close(WS_CLOSE_PROTOCOL);
+        }
+        if (len + plen > size) {
+            return _close(WS_CLOSE_TOO_BIG);
+        }
+        if (!_readExact(buf + len, plen)) {
+            return _close(WS_CLOSE_PROTOCOL);
+        }
+        for (uint32_t i = 0; i < plen; i++) {
+            buf[len + i] ^= mask[i & 3];
+        }
+        len += plen;
+        inMessage = true;
+        if (fin) {
+            return len;
+        }
+    }
+}
+
+bool AVRISPWebSocket::_readExact(uint8_t* buf, size_t len) {
+    uint32_t started = millis();
+    while (len) {
+        size_t avail = _client.available();
+        if (!avail) {
+            if (!_client.connected() || millis() - started > AVRISP_WS_TIMEOUT) {
+                return false;
+            }
+            delay(1);
+            continue;
+        }
+        if (avail > len) {
+            avail = len;
+        }
+        avail = _client.read(buf, avail);
+        buf += avail;
+        len -= avail;
+    }
+    return true;
+}
+
+bool AVRISPWebSocket::send(uint8_t* payload, size_t len) {
+    if (!connected() || len > 0xFFFF) {
+        return false;
+    }
+    // server frames are not masked
+    uint8_t* frame;
+    if (len < 126) {
+        frame = payload - 2;
+        frame[1] = len;
+    } else {
+        frame = payload - 4;
+        frame[1] = 126;
+        frame[2] = len >> 8;
+        frame[3] = len & 0xFF;
+    }
+    frame[0] = 0x80 | WS_OP_BINARY;
+    size_t total = len + (payload - frame);
+    return _client.write(frame, total) == total;
+}
+
+bool AVRISPWebSocket::_sendControl(uint8_t opcode, const uint8_t* data, size_t len) {
+    uint8_t frame[2 + 125];
+    frame[0] = 0x80 | opcode;
+    frame[1] = len;
+    memcpy(frame + 2, data, len);
+    return _client.write(frame, len + 2) == len + 2;
+}
+
+int AVRISPWebSocket::_close(uint16_t code) {
+    uint8_t data[2] = { (uint8_t)(code >> 8), (uint8_t)(code & 0xFF) };
+    _sendControl(WS_OP_CLOSE, data, 2);
+    _client.stop();
+    _open = false;
+    return -1;
+}
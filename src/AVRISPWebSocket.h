@@ -0,0 +1,51 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+Minimal single client WebSocket server (RFC 6455) carrying raw STK500 frames
+in binary messages. Only what the programmer needs is implemented: the
+upgrade handshake, (fragmented) binary messages, ping/pong and close.
+*/
+
+#ifndef AVRISPWEBSOCKET_H
+#define AVRISPWEBSOCKET_H
+
+#include <ESP8266WiFi.h>
+
+// bytes that must be writable in front of a payload passed to send()
+#define AVRISP_WS_HEADROOM 4
+
+// time to wait for the rest of a handshake or frame, in ms
+#define AVRISP_WS_TIMEOUT 1000
+
+class AVRISPWebSocket
+{
+public:
+    AVRISPWebSocket(int port);
+
+    void begin();
+
+    // accept a client, complete its handshake and read the next binary
+    // message into buf. returns the message length, 0 if there is none yet,
+    // -1 if the connection was closed, dropped or timed out
+    int poll(uint8_t* buf, size_t size);
+
+    // send one binary message. payload must be preceded by
+    // AVRISP_WS_HEADROOM writable bytes, the frame header is put there
+    bool send(uint8_t* payload, size_t len);
+
+    bool connected() { return _open && _client.connected(); }
+
+protected:
+    bool _handshake();
+    int _readMessage(uint8_t* buf, size_t size);
+    bool _readExact(uint8_t* buf, size_t len);
+    bool _sendControl(uint8_t opcode, const uint8_t* data, size_t len);
+    int _close(uint16_t code);
+
+    WiFiServer _server;
+    WiFiClient _client;
+    bool _open;                 // handshake done
+};
+
+#endif //AVRISPWEBSOCKET_H
@@ -13,12 +13,14 @@ Original version:
 */
 #include "ESP8266AVRISPWebServer.h"
 #include <Arduino.h>
-#include <SPI.h>
 #include <pgmspace.h>
 #include <ESP8266WiFi.h>
-#include <map>
 
 #include "httpcommand.h"
+#include "AVRISPIntelHex.h"
+#include "AVRISPArena.h"
+#include "AVRISPWebSocket.h"
+#include "AVRISPImage.h"
 
 extern "C" {
     #include "user_interface.h"
@@ -31,55 +33,15 @@ extern "C" {
 // #define AVRISP_DEBUG(fmt, ...)     os_printf("[AVRP] " fmt "\r\n", ##__VA_ARGS__ )
 #define AVRISP_DEBUG(...)
 
-#define AVRISP_HWVER 2
-#define AVRISP_SWMAJ 1
-#define AVRISP_SWMIN 18
-#define AVRISP_PTIME 10
+// fixed part of every STK500 reply header, only Content-Length changes
+static const char STK_REPLY_KEEPALIVE[] PROGMEM =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: keep-alive\r\nContent-Length: ";
+static const char STK_REPLY_CLOSE[] PROGMEM =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\nContent-Length: ";
 
-#define EECHUNK (32)
+// request lines on Serial, /stats has the numbers without slowing requests down
+// #define HTTP_ESPAVRISP_DEBUG
 
-#define beget16(addr) (*addr * 256 + *(addr+1))
-
-#define HTTP_ESPAVRISP_DEBUG
-
-#ifdef HTTP_ESPAVRISP_DEBUG
-std::map<uint8_t, char*> cmd_debug =
-{
-	{ Cmnd_STK_GET_SYNC         , "Cmnd_STK_GET_SYNC       " },
-	{ Cmnd_STK_GET_SIGN_ON      , "Cmnd_STK_GET_SIGN_ON    " },
-	{ Cmnd_STK_RESET            , "Cmnd_STK_RESET          " },
-	{ Cmnd_STK_SINGLE_CLOCK     , "Cmnd_STK_SINGLE_CLOCK   " },
-	{ Cmnd_STK_STORE_PARAMETERS , "Cmnd_STK_STORE_PARAMETER" },
-	{ Cmnd_STK_SET_PARAMETER    , "Cmnd_STK_SET_PARAMETER  " },
-	{ Cmnd_STK_GET_PARAMETER    , "Cmnd_STK_GET_PARAMETER  " },
-	{ Cmnd_STK_SET_DEVICE       , "Cmnd_STK_SET_DEVICE     " },
-	{ Cmnd_STK_GET_DEVICE       , "Cmnd_STK_GET_DEVICE     " },
-	{ Cmnd_STK_GET_STATUS       , "Cmnd_STK_GET_STATUS     " },
-	{ Cmnd_STK_SET_DEVICE_EXT   , "Cmnd_STK_SET_DEVICE_EXT " },
-	{ Cmnd_STK_ENTER_PROGMODE   , "Cmnd_STK_ENTER_PROGMODE " },
-	{ Cmnd_STK_LEAVE_PROGMODE   , "Cmnd_STK_LEAVE_PROGMODE " },
-	{ Cmnd_STK_CHIP_ERASE       , "Cmnd_STK_CHIP_ERASE     " },
-	{ Cmnd_STK_CHECK_AUTOINC    , "Cmnd_STK_CHECK_AUTOINC  " },
-	{ Cmnd_STK_CHECK_DEVICE     , "Cmnd_STK_CHECK_DEVICE   " },
-	{ Cmnd_STK_LOAD_ADDRESS     , "Cmnd_STK_LOAD_ADDRESS   " },
-	{ Cmnd_STK_UNIVERSAL        , "Cmnd_STK_UNIVERSAL      " },
-	{ Cmnd_STK_PROG_FLASH       , "Cmnd_STK_PROG_FLASH     " },
-	{ Cmnd_STK_PROG_DATA        , "Cmnd_STK_PROG_DATA      " },
-	{ Cmnd_STK_PROG_FUSE        , "Cmnd_STK_PROG_FUSE      " },
-	{ Cmnd_STK_PROG_LOCK        , "Cmnd_STK_PROG_LOCK      " },
-	{ Cmnd_STK_PROG_PAGE        , "Cmnd_STK_PROG_PAGE      " },
-	{ Cmnd_STK_PROG_FUSE_EXT    , "Cmnd_STK_PROG_FUSE_EXT  " },
-	{ Cmnd_STK_READ_FLASH       , "Cmnd_STK_READ_FLASH     " },
-	{ Cmnd_STK_READ_DATA        , "Cmnd_STK_READ_DATA      " },
-	{ Cmnd_STK_READ_FUSE        , "Cmnd_STK_READ_FUSE      " },
-	{ Cmnd_STK_READ_LOCK        , "Cmnd_STK_READ_LOCK      " },
-	{ Cmnd_STK_READ_PAGE        , "Cmnd_STK_READ_PAGE      " },
-	{ Cmnd_STK_READ_SIGN        , "Cmnd_STK_READ_SIGN      " },
-	{ Cmnd_STK_READ_OSCCAL      , "Cmnd_STK_READ_OSCCAL    " },
-	{ Cmnd_STK_READ_FUSE_EXT    , "Cmnd_STK_READ_FUSE_EXT  " },
-	{ Cmnd_STK_READ_OSCCAL_EXT  , "Cmnd_STK_READ_OSCCAL_EXT" }
-};
-#endif
 
 static char* readBytesWithTimeout2(WiFiClient& client, size_t maxLength, size_t& dataLength, int timeout_ms)
 {
@@ -92,6 +54,10 @@ static char* readBytesWithTimeout2(WiFiClient& client, size_t maxLength, size_t&
     if (!newLength) {
       break;
     }
+    // never read into a pipelined request following this body
+    if (newLength > maxLength - dataLength) {
+      newLength = maxLength - dataLength;
+    }
     if (!buf) {
       buf = (char *) malloc(newLength + 1);
       if (!buf) {
@@ -114,38 +80,93 @@ static char* readBytesWithTimeout2(WiFiClient& client, size_t maxLength, size_t&
 }
 
 
-ESP8266AVRISPWebServer::ESP8266AVRISPWebServer(IPAddress addr, int port, uint8_t reset_pin, uint32_t spi_freq, bool reset_state, bool reset_activehigh):
+ESP8266AVRISPWebServer::ESP8266AVRISPWebServer(IPAddress addr, int port, uint8_t reset_pin, uint32_t spi_freq, bool reset_state, bool reset_activehigh, size_t body_size):
 ESP8266WebServer(addr, port),
-_reset_pin(reset_pin),
-_reset_state(reset_state),
-_spi_freq(spi_freq),
-_reset_activehigh(reset_activehigh),
+_arena(AVRISP_PAGE_SIZE, body_size, body_size, AVRISP_REPLY_HEADROOM),
+_resetPin(reset_pin, reset_activehigh),
+_engine(_spiBus, _resetPin, _clock, _arena, spi_freq),
 _state(HTTP_AVRISP_STATE_IDLE),
-_currentBodyIndex(0),
-_bodyLen(0)
+_bodyLen(0),
+_bodyOverflow(false),
+_bodyRemaining(0),
+_bodyChunked(false),
+_chunkRemaining(0),
+_chunkCrlf(false),
+_keepAlive(false),
+_replyKeepAlive(false),
+_requestsOnConnection(0),
+_ws(AVRISP_WS_PORT),
+_avrispServer(AVRISP_TCP_PORT),
+_jobState(AVRISP_JOB_IDLE),
+_jobDone(0)
 {
-	pinMode(_reset_pin, OUTPUT);
-    setReset(_reset_state);
+	_body = (char *)_arena.body();
+	_resetPin.begin();
+	_engine.setTargets(&_resetPin);
+	_parseTime.clear();
+	_sendTime.clear();
+	memset(&_last, 0, sizeof(_last));
+    setReset(reset_state);
 	RegisterAVRISP();
 }
 
-ESP8266AVRISPWebServer::ESP8266AVRISPWebServer(int port, uint8_t reset_pin, uint32_t spi_freq, bool reset_state, bool reset_activehigh):
+ESP8266AVRISPWebServer::ESP8266AVRISPWebServer(int port, uint8_t reset_pin, uint32_t spi_freq, bool reset_state, bool reset_activehigh, size_t body_size):
 ESP8266WebServer(port),
-_reset_pin(reset_pin),
-_reset_state(reset_state),
-_spi_freq(spi_freq),
-_reset_activehigh(reset_activehigh),
+_arena(AVRISP_PAGE_SIZE, body_size, body_size, AVRISP_REPLY_HEADROOM),
+_resetPin(reset_pin, reset_activehigh),
+_engine(_spiBus, _resetPin, _clock, _arena, spi_freq),
 _state(HTTP_AVRISP_STATE_IDLE),
-_currentBodyIndex(0),
-_bodyLen(0)
+_bodyLen(0),
+_bodyOverflow(false),
+_bodyRemaining(0),
+_bodyChunked(false),
+_chunkRemaining(0),
+_chunkCrlf(false),
+_keepAlive(false),
+_replyKeepAlive(false),
+_requestsOnConnection(0),
+_ws(AVRISP_WS_PORT),
+_avrispServer(AVRISP_TCP_PORT),
+_jobState(AVRISP_JOB_IDLE),
+_jobDone(0)
 {
-	pinMode(_reset_pin, OUTPUT);
-    setReset(_reset_state);
+	_body = (char *)_arena.body();
+	_resetPin.begin();
+	_engine.setTargets(&_resetPin);
+	_parseTime.clear();
+	_sendTime.clear();
+	memset(&_last, 0, sizeof(_last));
+    setReset(reset_state);
 	RegisterAVRISP();
 }
 
+void ESP8266AVRISPWebServer::begin()
+{
+	ESP8266WebServer::begin();
+#if AVRISP_WS_PORT
+	_ws.begin();
+#endif
+#if AVRISP_TCP_PORT
+	_avrispServer.begin();
+	_avrispServer.setNoDelay(true);
+#endif
+}
+
 void ESP8266AVRISPWebServer::handleClient2()
 {
+	runJob();
+	// STK500 streams wait while a job has the target
+	if (_jobState != AVRISP_JOB_RUNNING) {
+#if AVRISP_WS_PORT
+		handleWebSocket();
+#endif
+#if AVRISP_TCP_PORT
+		if (update() != HTTP_AVRISP_STATE_IDLE) {
+			serve();
+		}
+#endif
+	}
+
 	if (_currentStatus == HC_NONE) {
     WiFiClient client = _server.available();
     if (!client) {
@@ -156,9 +177,12 @@ void ESP8266AVRISPWebServer::handleClient2()
     DEBUG_OUTPUT.println("New client");
 #endif
 
+    // replies are single writes, don't hold them back waiting for acks
+    client.setNoDelay(true);
     _currentClient = client;
     _currentStatus = HC_WAIT_READ;
     _statusChange = millis();
+    _requestsOnConnection = 0;
   }
 
   if (!_currentClient.connected()) {
@@ -170,7 +194,15 @@ void ESP8266AVRISPWebServer::handleClient2()
   // Wait for data from client to become available
   if (_currentStatus == HC_WAIT_READ) {
     if (!_currentClient.available()) {
-      if (millis() - _statusChange > HTTP_MAX_DATA_WAIT) {
+      if (_requestsOnConnection > 0 && _server.hasClient()) {
+        // idle persistent connection, make way for the waiting client
+        _currentClient.stop();
+        _currentClient = WiFiClient();
+        _currentStatus = HC_NONE;
+        return;
+      }
+      uint32_t timeout = _requestsOnConnection > 0 ? AVRISP_KEEPALIVE_TIMEOUT : HTTP_MAX_DATA_WAIT;
+      if (millis() - _statusChange > timeout) {
         _currentClient = WiFiClient();
         _currentStatus = HC_NONE;
       }
@@ -178,24 +210,37 @@ void ESP8266AVRISPWebServer::handleClient2()
       return;
     }
 
-    if (!_parseRequest2(_currentClient)) {
-      _currentClient = WiFiClient();
-      _currentStatus = HC_NONE;
-      return;
-    }
+    // serve requests already queued in the socket back to back
+    for (int pipelined = 0; pipelined < AVRISP_MAX_PIPELINE; pipelined++) {
+      uint32_t parseStarted = micros();
+      if (!_parseRequest2(_currentClient)) {
+        _currentClient = WiFiClient();
+        _currentStatus = HC_NONE;
+        return;
+      }
+      _parseTime.add(micros() - parseStarted);
 
-    _contentLength = CONTENT_LENGTH_NOT_SET;
-    _handleRequest();
+      _contentLength = CONTENT_LENGTH_NOT_SET;
+      _replyKeepAlive = false;
+      _handleRequest();
+      _requestsOnConnection++;
 
-    if (!_currentClient.connected()) {
-      _currentClient = WiFiClient();
-      _currentStatus = HC_NONE;
-      return;
-    } else {
-      _currentStatus = HC_WAIT_CLOSE;
+      if (!_currentClient.connected()) {
+        _currentClient = WiFiClient();
+        _currentStatus = HC_NONE;
+        return;
+      }
+      if (!_replyKeepAlive) {
+        _currentStatus = HC_WAIT_CLOSE;
+        _statusChange = millis();
+        return;
+      }
       _statusChange = millis();
-      return;
+      if (!_currentClient.available()) {
+        break;
+      }
     }
+    return;
   }
 
   if (_currentStatus == HC_WAIT_CLOSE) {
@@ -220,6 +265,10 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
   for (int i = 0; i < _headerKeysCount; ++i) {
     _currentHeaders[i].value =String();
    }
+  _bodyLen = 0;
+  _bodyOverflow = false;
+  _bodyRemaining = 0;
+  _bodyChunked = false;
 
   // First line of HTTP request looks like "GET /path HTTP/1.1"
   // Retrieve the "/path" part by finding the spaces
@@ -233,6 +282,9 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
     return false;
   }
 
+  // HTTP/1.1 connections persist unless the client says otherwise
+  _keepAlive = req.substring(addr_end + 1) == "HTTP/1.1";
+
   String methodStr = req.substring(0, addr_start);
   String url = req.substring(addr_start + 1, addr_end);
   String searchStr = "";
@@ -282,6 +334,8 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
     String headerValue;
     bool isForm = false;
     uint32_t contentLength = 0;
+    _chunkRemaining = 0;
+    _chunkCrlf = false;
     //parse headers
     while(1){
       req = client.readStringUntil('\r');
@@ -315,11 +369,31 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
         }
       } else if (headerName == "Content-Length"){
         contentLength = headerValue.toInt();
+      } else if (headerName == "Transfer-Encoding"){
+        _bodyChunked = headerValue.startsWith("chunked");
+      } else if (headerName == "Connection"){
+        _parseConnection(headerValue);
       } else if (headerName == "Host"){
         _hostHeader = headerValue;
       }
     }
 
+    if (_rawBody(url)){
+      // binary STK500 body: read straight into the arena, no String copies.
+      // only the query string is parsed, or arg() would still return the
+      // arguments of the previous request on the connection
+      _bodyRemaining = contentLength;
+      _parseArguments(searchStr);
+      return _readRawBody();
+    }
+
+    if (_streamedBody(url)){
+      // body stays in the socket, the handler pulls it with readBody()
+      _bodyRemaining = contentLength;
+      _parseArguments(searchStr);
+      return true;
+    }
+
     if (!isForm){
       size_t plainLength;
       char* plainBuf = readBytesWithTimeout2(client, contentLength, plainLength, HTTP_MAX_POST_WAIT);
@@ -335,14 +409,19 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
 	  Serial.println("uri: ");
 	  Serial.println(_currentUri);
 #endif
-	  for(byte i = 0; i < plainLength; ++i){
-		  _body[i] = plainBuf[i];
-		  Serial.print("Body data: ");
-		  Serial.print(i);
-		  Serial.print(" ");
-		  Serial.println((int)_body[i], HEX);
+	  _bodyOverflow = plainLength > _arena.bodySize();
+	  if (_bodyOverflow) {
+		  _arena.overflow();
+		  _bodyLen = 0;
+	  } else {
+		  memcpy(_body, plainBuf, plainLength);
+		  _bodyLen = plainLength;
+		  _arena.useBody(plainLength);
 	  }
-	  _bodyLen = plainLength;
+#ifdef HTTP_ESPAVRISP_DEBUG
+	  Serial.print("Body length: ");
+	  Serial.println(plainLength);
+#endif
 #ifdef DEBUG_ESP_HTTP_SERVER
       DEBUG_OUTPUT.print("Plain: ");
       DEBUG_OUTPUT.println(plainBuf);
@@ -391,13 +470,15 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
 	  DEBUG_OUTPUT.println(headerValue);
 	  #endif
 
-	  if (headerName == "Host"){
+	  if (headerName == "Connection"){
+        _parseConnection(headerValue);
+      } else if (headerName == "Host"){
         _hostHeader = headerValue;
       }
     }
     _parseArguments(searchStr);
   }
-  client.flush();
+  // no client.flush() here, it would discard pipelined requests
 
 #ifdef DEBUG_ESP_HTTP_SERVER
   DEBUG_OUTPUT.print("Request: ");
@@ -409,562 +490,1145 @@ bool ESP8266AVRISPWebServer::_parseRequest2(WiFiClient& client) {
   return true;
 }
 
-void ESP8266AVRISPWebServer::setSpiFrequency(uint32_t freq) {
-    _spi_freq = freq;
-    if (_state == HTTP_AVRISP_STATE_ACTIVE) {
-        SPI.setFrequency(freq);
-    }
+void ESP8266AVRISPWebServer::_parseConnection(const String& value) {
+  if (value.equalsIgnoreCase("close")) {
+    _keepAlive = false;
+  } else if (value.equalsIgnoreCase("keep-alive")) {
+    _keepAlive = true;
+  }
 }
 
-void ESP8266AVRISPWebServer::RegisterAVRISP()
-{
-	on("/cmd", HTTP_POST, [this]{ avrisp(); });
+bool ESP8266AVRISPWebServer::_streamedBody(const String& uri) {
+  return uri == "/flash" || uri == "/image";
 }
 
-void ESP8266AVRISPWebServer::setReset(bool rst) {
-    _reset_state = rst;
-    digitalWrite(_reset_pin, _resetLevel(_reset_state));
+bool ESP8266AVRISPWebServer::_rawBody(const String& uri) {
+  return uri == "/cmd";
 }
 
-HTTPAVRISPState_t ESP8266AVRISPWebServer::update() {
-    switch (_state) {
-        case HTTP_AVRISP_STATE_IDLE: {
-            if (_server.hasClient()) {
-                _client = _server.available();
-                _client.setNoDelay(true);
-                ip_addr_t lip;
-                lip.addr = _client.remoteIP();
-                AVRISP_DEBUG("client connect %d.%d.%d.%d:%d", IP2STR(&lip), _client.remotePort());
-                _client.setTimeout(100); // for getch()
-                _state = HTTP_AVRISP_STATE_PENDING;
-                _reject_incoming();
-            }
-            break;
-        }
-        case HTTP_AVRISP_STATE_PENDING:
-        case HTTP_AVRISP_STATE_ACTIVE: {
-            // handle disconnect
-            if (!_client.connected()) {
-                _client.stop();
-                AVRISP_DEBUG("client disconnect");
-                if (pmode) {
-                    SPI.end();
-                    pmode = 0;
-                }
-                setReset(_reset_state);
-                _state = HTTP_AVRISP_STATE_IDLE;
-            } else {
-                _reject_incoming();
-            }
-            break;
-        }
+// read the whole body of a raw request into _body, a body larger than the
+// arena is flagged as overflow and left unread
+bool ESP8266AVRISPWebServer::_readRawBody() {
+  size_t size = _arena.bodySize();
+  if (!_bodyChunked && _bodyRemaining > size) {
+    _bodyOverflow = true;
+    _arena.overflow();
+    return true;
+  }
+  while (true) {
+    if (_bodyLen == size) {
+      // full, make sure nothing is left of a chunked body
+      uint8_t probe;
+      int n = readBody(&probe, 1);
+      if (n < 0) {
+        return false;
+      }
+      if (n > 0) {
+        _bodyOverflow = true;
+        _arena.overflow();
+        _bodyLen = 0;
+        return true;
+      }
+      break;
     }
-    return _state;
+    int n = readBody((uint8_t*)_body + _bodyLen, size - _bodyLen);
+    if (n < 0) {
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    _bodyLen += n;
+  }
+  _arena.useBody(_bodyLen);
+  return true;
 }
 
-HTTPAVRISPState_t ESP8266AVRISPWebServer::serve() {
-    switch (update()) {
-        case HTTP_AVRISP_STATE_IDLE:
-            // should not be called when idle, error?
-            break;
-        case HTTP_AVRISP_STATE_PENDING: {
-            _state = HTTP_AVRISP_STATE_ACTIVE;
-        // fallthrough
-        }
-        case HTTP_AVRISP_STATE_ACTIVE: {
-            while (_client.available()) {
-                avrisp();
-            }
-            return update();
-        }
+// one line of the chunk framing into line, without its CRLF. returns the
+// length, -1 if the client stalls or the line does not fit
+int ESP8266AVRISPWebServer::_readChunkLine(char* line, size_t size) {
+  WiFiClient& client = _currentClient;
+  size_t len = 0;
+  int tries = HTTP_MAX_POST_WAIT;
+  while (true) {
+    if (!client.available()) {
+      if (!tries--) {
+        return -1;
+      }
+      delay(1);
+      continue;
     }
-    return _state;
+    char c = client.read();
+    if (c == '\n') {
+      break;
+    }
+    if (len + 1 >= size) {
+      return -1;
+    }
+    line[len++] = c;
+  }
+  if (len && line[len - 1] == '\r') {
+    len--;
+  }
+  line[len] = 0;
+  return len;
 }
 
-inline void ESP8266AVRISPWebServer::_reject_incoming(void) {
-    while (_server.hasClient()) _server.available().stop();
+// read up to len bytes of a streamed request body, decoding chunked transfer
+// encoding on the fly. returns the number of bytes read, 0 at the end of the
+// body and -1 if the client stalls or the chunk framing is broken
+int ESP8266AVRISPWebServer::readBody(uint8_t* buf, size_t len) {
+  WiFiClient& client = _currentClient;
+  if (_bodyChunked && _chunkRemaining == 0) {
+    char line[AVRISP_CHUNK_LINE];
+    if (_chunkCrlf) {
+      // CRLF closing the previous chunk
+      if (_readChunkLine(line, sizeof(line)) != 0) {
+        return -1;
+      }
+      _chunkCrlf = false;
+    }
+    if (_readChunkLine(line, sizeof(line)) < 0) {
+      return -1;
+    }
+    // hex size, optionally followed by chunk extensions. strtoul alone would
+    // take an empty or garbled line as the last chunk
+    char* end;
+    unsigned long size = strtoul(line, &end, 16);
+    if (!isxdigit(line[0]) || line[1] == 'x' || line[1] == 'X'
+        || (*end && *end != ';' && *end != ' ' && *end != '\t')) {
+      return -1;
+    }
+    if (size == 0) {
+      // last chunk, drop the trailer up to the empty line
+      int n;
+      do {
+        n = _readChunkLine(line, sizeof(line));
+      } while (n > 0);
+      if (n < 0) {
+        return -1;
+      }
+      _bodyChunked = false;
+      _bodyRemaining = 0;
+      return 0;
+    }
+    _chunkRemaining = size;
+    _chunkCrlf = true;
+  }
+  size_t left = _bodyChunked ? _chunkRemaining : _bodyRemaining;
+  if (len > left) {
+    len = left;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  int tries = HTTP_MAX_POST_WAIT;
+  size_t avail;
+  while (!(avail = client.available()) && tries--) delay(1);
+  if (!avail) {
+    return -1;
+  }
+  if (len > avail) {
+    len = avail;
+  }
+  len = client.readBytes(buf, len);
+  if (_bodyChunked) {
+    _chunkRemaining -= len;
+  } else {
+    _bodyRemaining -= len;
+  }
+  return len;
 }
 
-uint8_t ESP8266AVRISPWebServer::getch() {
-#if 0
-    while (!_client.available()) yield();
-    uint8_t b = (uint8_t)_client.read();
-#endif
-    uint8_t b = _body[_currentBodyIndex++];
-    // AVRISP_DEBUG("< %02x", b);
-    return b;
+void ESP8266AVRISPWebServer::setSpiFrequency(uint32_t freq) {
+    _engine.setSpiFrequency(freq);
 }
 
-void ESP8266AVRISPWebServer::fill(int n) {
-    // AVRISP_DEBUG("fill(%u)", n);
-    for (int x = 0; x < n; x++) {
-        buff[x] = getch();
-    }
+void ESP8266AVRISPWebServer::RegisterAVRISP()
+{
+	on("/cmd", HTTP_POST, [this]{ handleCommands(); });
+	on("/flash", HTTP_POST, [this]{ handleFlash(); });
+	on("/verify", HTTP_GET, [this]{ handleVerify(); });
+	on("/image", HTTP_POST, [this]{ handleImageUpload(); });
+	on("/image", HTTP_GET, [this]{ handleImageList(); });
+	on("/image", HTTP_DELETE, [this]{ handleImageDelete(); });
+	on("/program", HTTP_POST, [this]{ handleProgram(); });
+	on("/dump", HTTP_GET, [this]{ handleDump(); });
+	on("/status", HTTP_GET, [this]{ handleStatus(200); });
+	on("/abort", HTTP_POST, [this]{ handleAbort(); });
+	on("/stats", HTTP_GET, [this]{ handleStats(); });
+	on("/stats", HTTP_DELETE, [this]{ clearStats(); send(200, "text/plain", "cleared"); });
 }
 
-uint8_t ESP8266AVRISPWebServer::spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
-    uint8_t n;
-    SPI.transfer(a);
-    n = SPI.transfer(b);
-    n = SPI.transfer(c);
-    return SPI.transfer(d);
+// send a complete response. the connection is kept open for the next request
+// if the client allows it and nothing of the request body is left unread
+void ESP8266AVRISPWebServer::sendReply(int code, const char* content_type, const uint8_t* data, size_t len)
+{
+	_replyKeepAlive = _keepAlive && !_bodyOverflow && _bodyRemaining == 0 && !_bodyChunked;
+	String header = "HTTP/1.1 ";
+	header += code;
+	header += ' ';
+	header += _responseCodeToString(code);
+	header += "\r\nContent-Type: ";
+	header += content_type;
+	header += "\r\nContent-Length: ";
+	header += (unsigned)len;
+	header += _replyKeepAlive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+	uint32_t started = micros();
+	_currentClient.write((const uint8_t *)header.c_str(), header.length());
+	if (len) {
+		_currentClient.write(data, len);
+	}
+	_sendTime.add(micros() - started);
 }
 
-void ESP8266AVRISPWebServer::empty_reply() {
-	char resp[2];
-    if (Sync_CRC_EOP == getch()) {
-    	resp[0] = Resp_STK_INSYNC;
-    	resp[1] = Resp_STK_OK;
-        //_client.print((char)Resp_STK_INSYNC);
-        //_client.print((char)Resp_STK_OK);
-    	send_P(200, "text/plain", (const char *)resp, 2);
-    } else {
-        error++;
-    	resp[0] = Resp_STK_NOSYNC;
-    	resp[1] = Resp_STK_OK;
-        //_client.print((char)Resp_STK_NOSYNC);
-    	send_P(200, "text/plain", (const char *)resp, 2);
-    }
+// send the queued STK500 replies. the header is assembled from a constant
+// template in the arena headroom right in front of the replies, so header and
+// payload leave in a single write (and a single TCP segment for short replies)
+void ESP8266AVRISPWebServer::sendStkReply()
+{
+	_replyKeepAlive = _keepAlive;
+	PGM_P tmpl = _replyKeepAlive ? STK_REPLY_KEEPALIVE : STK_REPLY_CLOSE;
+	size_t tmplLen = _replyKeepAlive ? sizeof(STK_REPLY_KEEPALIVE) - 1 : sizeof(STK_REPLY_CLOSE) - 1;
+
+	char digits[10];
+	size_t ndigits = 0;
+	size_t len = _engine.replyLen();
+	do {
+		digits[ndigits++] = '0' + len % 10;
+		len /= 10;
+	} while (len);
+
+	size_t headerLen = tmplLen + ndigits + 4;
+	uint8_t* header = _engine.reply() - headerLen;
+	memcpy_P(header, tmpl, tmplLen);
+	uint8_t* p = header + tmplLen;
+	while (ndigits) {
+		*p++ = digits[--ndigits];
+	}
+	memcpy(p, "\r\n\r\n", 4);
+	uint32_t started = micros();
+	_currentClient.write(header, headerLen + _engine.replyLen());
+	_sendTime.add(micros() - started);
 }
 
-void ESP8266AVRISPWebServer::breply(uint8_t b) {
-    uint8_t resp[3];
-    if (Sync_CRC_EOP == getch()) {
-        resp[0] = Resp_STK_INSYNC;
-        resp[1] = b;
-        resp[2] = Resp_STK_OK;
-        //_client.write((const uint8_t *)resp, (size_t)3);
-        send_P(200, "text/plain", (const char *)resp, 3);
-    } else {
-        error++;
-        //_client.print((char)Resp_STK_NOSYNC);
-        resp[0] = Resp_STK_NOSYNC;
-        resp[1] = b;
-        resp[2] = Resp_STK_OK;
-        send_P(200, "text/plain", (const char *)resp, 3);
-    }
-
+// run every STK500 command packed into the body, answer with all replies at once
+void ESP8266AVRISPWebServer::handleCommands()
+{
+	if (rejectBusy()) {
+		return;
+	}
+	if (!_arena.ok()) {
+		sendReply(500, "text/plain", (const uint8_t *)"no buffers", 10);
+		return;
+	}
+	if (_bodyOverflow) {
+		sendReply(413, "text/plain", (const uint8_t *)"body too large", 14);
+		return;
+	}
+	runCommands();
+	sendStkReply();
+	// the client is busy with the reply and the next request now
+	_engine.finishVerify();
 }
 
-void ESP8266AVRISPWebServer::get_parameter(uint8_t c) {
-    switch (c) {
-    case 0x80:
-        breply(AVRISP_HWVER);
-        break;
-    case 0x81:
-        breply(AVRISP_SWMAJ);
-        break;
-    case 0x82:
-        breply(AVRISP_SWMIN);
-        break;
-    case 0x93:
-        breply('S'); // serial programmer
-        break;
-    default:
-        breply(0);
-    }
+// dispatch every command in _body, the replies are queued by the engine
+void ESP8266AVRISPWebServer::runCommands()
+{
+	AVRISPBufferTransport in((const uint8_t *)_body, _bodyLen);
+	_engine.clearReply();
+	_engine.run(in);
 }
 
-void ESP8266AVRISPWebServer::set_parameters() {
-    // call this after reading paramter packet into buff[]
-    param.devicecode = buff[0];
-    param.revision   = buff[1];
-    param.progtype   = buff[2];
-    param.parmode    = buff[3];
-    param.polling    = buff[4];
-    param.selftimed  = buff[5];
-    param.lockbytes  = buff[6];
-    param.fusebytes  = buff[7];
-    param.flashpoll  = buff[8];
-    // ignore buff[9] (= buff[8])
-    // following are 16 bits (big endian)
-    param.eeprompoll = beget16(&buff[10]);
-    param.pagesize   = beget16(&buff[12]);
-    param.eepromsize = beget16(&buff[14]);
+// one binary WebSocket message carries one batch of STK500 commands, the
+// replies go back as one binary message
+void ESP8266AVRISPWebServer::handleWebSocket()
+{
+	if (!_arena.ok()) {
+		return;
+	}
+	int n = _ws.poll((uint8_t *)_body, _arena.bodySize());
+	if (n < 0) {
+		// the client is gone, as on a raw TCP disconnect do not leave the
+		// target held in reset
+		AVRISP_DEBUG("websocket disconnect");
+		if (_engine.inProgramMode()) {
+			_engine.endProgramMode();
+		}
+		return;
+	}
+	if (n == 0) {
+		return;
+	}
+	_bodyLen = n;
+	_arena.useBody(n);
+	runCommands();
+	uint32_t started = micros();
+	_ws.send(_engine.reply(), _engine.replyLen());
+	_sendTime.add(micros() - started);
+	_engine.finishVerify();
+}
 
-    // 32 bits flashsize (big endian)
-    param.flashsize = buff[16] * 0x01000000
-                    + buff[17] * 0x00010000
-                    + buff[18] * 0x00000100
-                    + buff[19];
+// page size for a request: the pagesize argument, else the device table entry
+// of signature, else what the engine has (table entry of the target in program
+// mode, or SET_DEVICE), else AVRISP_DEFAULT_PAGESIZE. 0 if it does not fit the
+// page buffer
+int ESP8266AVRISPWebServer::requestPageSize(uint32_t signature)
+{
+	AVRISP_parameter_t& param = _engine.parameters();
+	int pagesize = param.pagesize > 0 ? param.pagesize : AVRISP_DEFAULT_PAGESIZE;
+	AVRISP_device_t device;
+	if (signature && AVRISPDevices::find(signature, device)) {
+		pagesize = device.pagesize;
+	}
+	if (hasArg("pagesize")) {
+		pagesize = arg("pagesize").toInt();
+	}
+	if (pagesize <= 0 || pagesize > (int)_arena.pageSize() || (pagesize & 1)) {
+		return 0;
+	}
+	return pagesize;
 }
 
-void ESP8266AVRISPWebServer::start_pmode() {
-    SPI.begin();
-    SPI.setFrequency(_spi_freq);
-    SPI.setHwCs(false);
+// enter program mode unless the STK500 side already did, and apply the
+// incremental and verify arguments for this request. the erase argument (or
+// the default in erase) ends up in session.erase, the caller starts the chip
+// erase once it is sure about the target. pagesize 0 takes it from
+// requestPageSize() once the target is identified. false, and program mode
+// left again, if the page size is no good
+bool ESP8266AVRISPWebServer::beginSession(AVRISPSession_t& session, int pagesize, bool erase)
+{
+	session.ownPmode = !_engine.inProgramMode();
+	if (session.ownPmode) {
+		_engine.startProgramMode();
+	}
+	if (!pagesize) {
+		pagesize = requestPageSize();
+	}
+	if (!pagesize) {
+		if (session.ownPmode) {
+			_engine.endProgramMode();
+		}
+		return false;
+	}
+	_engine.parameters().pagesize = pagesize;
 
-    // try to sync the bus
-    SPI.transfer(0x00);
-    digitalWrite(_reset_pin, _resetLevel(false));
-    delayMicroseconds(50);
-    digitalWrite(_reset_pin, _resetLevel(true));
-    delay(30);
+	// incremental=1 skips the pages the target already holds for this request
+	session.incremental = _engine.incremental();
+	if (hasArg("incremental")) {
+		_engine.setIncremental(arg("incremental").toInt() != 0);
+	}
+	// verify=1 reads every page back while the next one is received
+	session.verify = _engine.verify();
+	if (hasArg("verify")) {
+		_engine.setVerify(arg("verify").toInt() != 0);
+	}
+	if (hasArg("erase")) {
+		erase = arg("erase").toInt() != 0;
+	}
+	session.erase = erase;
 
-    spi_transaction(0xAC, 0x53, 0x00, 0x00);
-    pmode = 1;
+	session.started = millis();
+	session.writeTime = _engine.flashWriteTime();
+	session.pages = _engine.pageCount();
+	session.bytes = 0;
+	return true;
 }
 
-void ESP8266AVRISPWebServer::end_pmode() {
-    SPI.end();
-    setReset(_reset_state);
-    pmode = 0;
+// leave program mode if beginSession() entered it, and reply with the
+// statistics of the session
+void ESP8266AVRISPWebServer::endSession(AVRISPSession_t& session, int code, const char* err)
+{
+	String json = finishSession(session, err);
+	sendReply(code, "application/json", (const uint8_t *)json.c_str(), json.length());
 }
 
-void ESP8266AVRISPWebServer::universal() {
-    int w;
-    uint8_t ch;
-
-    fill(4);
-    ch = spi_transaction(buff[0], buff[1], buff[2], buff[3]);
-    breply(ch);
+// leave program mode if beginSession() entered it, restore the engine
+// settings and return the statistics of the session as JSON
+String ESP8266AVRISPWebServer::finishSession(AVRISPSession_t& session, const char* err)
+{
+	_engine.finishVerify();
+	if (session.ownPmode) {
+		_engine.endProgramMode();
+	}
+	_engine.setIncremental(session.incremental);
+	_engine.setVerify(session.verify);
+
+	uint32_t elapsed = millis() - session.started;
+	uint32_t bps = elapsed ? session.bytes * 1000 / elapsed : session.bytes;
+	_last.bytes = session.bytes;
+	_last.ms = elapsed;
+	_last.bps = bps;
+	String json = "{\"bytes\":";
+	json += session.bytes;
+	json += ",\"ms\":";
+	json += elapsed;
+	json += ",\"bps\":";
+	json += bps;
+	// average page write cycle seen by the poller
+	const AVRISP_writetime_t& after = _engine.flashWriteTime();
+	if (after.count > session.writeTime.count) {
+		json += ",\"page_us\":";
+		json += (after.total_us - session.writeTime.total_us) / (after.count - session.writeTime.count);
+	}
+	const AVRISP_pagecount_t& pages = _engine.pageCount();
+	json += ",\"written\":";
+	json += pages.written - session.pages.written;
+	json += ",\"skipped\":";
+	json += (pages.blank - session.pages.blank) + (pages.unchanged - session.pages.unchanged);
+	const AVRISP_verify_t& verified = _engine.verifyResult();
+	if (verified.pages) {
+		json += ",\"verified\":";
+		json += verified.pages;
+		json += ",\"failed\":";
+		json += verified.failed;
+	}
+	if (_engine.targets() > 1) {
+		json += ",\"targets\":";
+		json += _engine.targets();
+		if (verified.failed_targets) {
+			json += ",\"failed_targets\":";
+			json += verified.failed_targets;
+		}
+	}
+	if (err) {
+		json += ",\"error\":\"";
+		json += err;
+		json += "\"";
+	}
+	json += "}";
+	return json;
 }
 
-void ESP8266AVRISPWebServer::flash(uint8_t hilo, int addr, uint8_t data) {
-    spi_transaction(0x40 + 8 * hilo,
-                    addr >> 8 & 0xFF,
-                    addr & 0xFF,
-                    data);
+// program an image while it is still arriving, one page at a time. the body
+// is Intel HEX if it starts with ':', a raw binary otherwise
+// optional arguments: addr (even byte address of a binary, default 0), pagesize (bytes),
+// erase, incremental, verify
+void ESP8266AVRISPWebServer::handleFlash()
+{
+	if (rejectBusy() || rejectAddr(2)) {
+		return;
+	}
+	AVRISPSession_t session;
+	// the page size of the target is known once it is in program mode
+	if (!beginSession(session, 0, false)) {
+		send(400, "text/plain", "bad pagesize");
+		return;
+	}
+	if (session.erase) {
+		// runs while the first page is received, blank pages are skipped after it
+		_engine.chipErase();
+	}
+	int pagesize = _engine.parameters().pagesize;
+	const char* err = receiveImage(pagesize, [this, &session](uint32_t addr, const uint8_t* data, size_t len) {
+		// fails on a page that incremental=1 can not write without erase=1
+		if (_engine.writeFlash(addr, len) != Resp_STK_OK) {
+			return false;
+		}
+		session.bytes += len;
+		return true;
+	});
+	if (err && _engine.pageCount().needs_erase != session.pages.needs_erase) {
+		err = "page needs chip erase";
+	}
+	endSession(session, err ? (strcmp(err, "timeout") ? 400 : 408) : 200, err);
 }
 
-void ESP8266AVRISPWebServer::commit(int addr) {
-    spi_transaction(0x4C, (addr >> 8) & 0xFF, addr & 0xFF, 0);
-    delay(AVRISP_PTIME);
+// read back summary of the pages written in the current or last programming session
+void ESP8266AVRISPWebServer::handleVerify()
+{
+	// finishVerify() reads the target
+	if (rejectBusy()) {
+		return;
+	}
+	_engine.finishVerify();
+	const AVRISP_verify_t& v = _engine.verifyResult();
+	char crc[9], expected[9];
+	snprintf(crc, sizeof(crc), "%08x", (unsigned)v.crc32);
+	snprintf(expected, sizeof(expected), "%08x", (unsigned)v.expected);
+	String json = "{\"pages\":";
+	json += v.pages;
+	json += ",\"failed\":";
+	json += v.failed;
+	if (v.failed) {
+		json += ",\"first_bad\":";
+		json += v.first_bad;
+		if (_engine.targets() > 1) {
+			json += ",\"failed_targets\":";
+			json += v.failed_targets;
+		}
+	}
+	json += ",\"crc32\":\"";
+	json += crc;
+	json += "\",\"expected\":\"";
+	json += expected;
+	json += "\",\"ok\":";
+	json += v.pages && !v.failed ? "true" : "false";
+	json += "}";
+	sendReply(200, "application/json", (const uint8_t *)json.c_str(), json.length());
 }
 
-//#define _addr_page(x) (here & 0xFFFFE0)
-int ESP8266AVRISPWebServer::addr_page(int addr) {
-    if (param.pagesize == 32)  return addr & 0xFFFFFFF0;
-    if (param.pagesize == 64)  return addr & 0xFFFFFFE0;
-    if (param.pagesize == 128) return addr & 0xFFFFFFC0;
-    if (param.pagesize == 256) return addr & 0xFFFFFF80;
-    AVRISP_DEBUG("unknown page size: %d", param.pagesize);
-    return addr;
+// store an image in the file system for /program, the body is the same as
+// for /flash. arguments: name, pagesize, signature (target, e.g. 1e950f)
+void ESP8266AVRISPWebServer::handleImageUpload()
+{
+	if (rejectBusy()) {
+		return;
+	}
+	String name = arg("name");
+	if (!AVRISPImage::validName(name)) {
+		send(400, "text/plain", "bad name");
+		return;
+	}
+	uint32_t sig = hasArg("signature") ? strtoul(arg("signature").c_str(), nullptr, 16) : 0;
+	uint8_t signature[3] = { (uint8_t)(sig >> 16), (uint8_t)(sig >> 8), (uint8_t)sig };
+	// page size of the part, if the device table knows the signature
+	int pagesize = requestPageSize(sig);
+	if (!pagesize) {
+		send(400, "text/plain", "bad pagesize");
+		return;
+	}
+	// pages are stored whole
+	if (rejectAddr(pagesize)) {
+		return;
+	}
+	AVRISPImage image;
+	if (!image.create(name, signature, pagesize)) {
+		send(500, "text/plain", "can not create image");
+		return;
+	}
+	const char* err = receiveImage(pagesize, [&image](uint32_t addr, const uint8_t* data, size_t len) {
+		return image.addPage(addr, data, len);
+	});
+	if (!err && !image.commit()) {
+		err = "file system full";
+	}
+	if (err) {
+		// close() drops the partial image
+		image.close();
+		String msg = err;
+		sendReply(strcmp(err, "timeout") ? 400 : 408, "text/plain", (const uint8_t *)msg.c_str(), msg.length());
+		return;
+	}
+	const AVRISP_image_t& m = image.manifest();
+	char crc[9];
+	snprintf(crc, sizeof(crc), "%08x", (unsigned)m.crc32);
+	String json = "{\"name\":\"";
+	json += name;
+	json += "\",\"pages\":";
+	json += m.pages;
+	json += ",\"crc32\":\"";
+	json += crc;
+	json += "\"}";
+	sendReply(200, "application/json", (const uint8_t *)json.c_str(), json.length());
 }
 
+void ESP8266AVRISPWebServer::handleImageList()
+{
+	String json = AVRISPImage::list();
+	sendReply(200, "application/json", (const uint8_t *)json.c_str(), json.length());
+}
 
-void ESP8266AVRISPWebServer::write_flash(int length) {
-    uint32_t started = millis();
+void ESP8266AVRISPWebServer::handleImageDelete()
+{
+	// the job reads its image from the file system
+	if (rejectBusy()) {
+		return;
+	}
+	if (!AVRISPImage::remove(arg("name"))) {
+		send(404, "text/plain", "no such image");
+		return;
+	}
+	send(200, "text/plain", "deleted");
+}
 
-    fill(length);
-	
-	uint8_t resp[2];
+// program a stored image, straight from the file system to the target. it
+// runs as a background job from handleClient2(), GET /status shows its
+// progress and POST /abort stops it.
+// arguments: image, erase (default 1), incremental, verify
+void ESP8266AVRISPWebServer::handleProgram()
+{
+	if (rejectBusy()) {
+		return;
+	}
+	AVRISPImage& image = _jobImage;
+	if (!image.open(arg("image"))) {
+		send(404, "text/plain", "no such image");
+		return;
+	}
+	if (!image.check()) {
+		image.close();
+		send(409, "text/plain", "image corrupt");
+		return;
+	}
+	const AVRISP_image_t& m = image.manifest();
+	if (m.pagesize > _arena.pageSize()) {
+		image.close();
+		send(400, "text/plain", "bad pagesize");
+		return;
+	}
+	uint32_t want = ((uint32_t)m.signature[0] << 16) | (m.signature[1] << 8) | m.signature[2];
+
+	// the image holds no blank pages, so it needs an erased target. the
+	// erase waits for the signature and page size checks, a wrong board on
+	// the jig is left as it is
+	if (!beginSession(_jobSession, m.pagesize, true)) {
+		image.close();
+		send(400, "text/plain", "bad pagesize");
+		return;
+	}
+	const char* err = nullptr;
+	for (uint8_t t = 0; want && !err && t < _engine.targets(); t++) {
+		// a gang without MISO buffers can only check them all at once
+		if ((t == 0 || _engine.selectTarget(t)) && _engine.readSignature() != want) {
+			err = "wrong target";
+		}
+	}
+	_engine.selectTarget(0);
+	const AVRISP_device_t* device = _engine.device();
+	if (!err && device && device->pagesize != m.pagesize) {
+		err = "wrong pagesize";
+	}
+	if (err) {
+		image.close();
+		endSession(_jobSession, 409, err);
+		return;
+	}
+	if (_jobSession.erase) {
+		_engine.chipErase();
+	}
 
-    if (Sync_CRC_EOP == getch()) {
-        //_client.print((char) Resp_STK_INSYNC);
-        //_client.print((char) write_flash_pages(length));
-		resp[0] = Resp_STK_INSYNC;
-		resp[1] = write_flash_pages(length);
-		send_P(200, "text/plain", (const char *)resp, 2);
-    } else {
-      error++;
-      //_client.print((char) Resp_STK_NOSYNC);
-	  resp[0] = Resp_STK_NOSYNC;
-	  send_P(200, "text/plain", (const char *)resp, 1);
-    }
+	_jobName = arg("image");
+	_jobDone = 0;
+	_jobResult = "";
+	_jobState = AVRISP_JOB_RUNNING;
+	handleStatus(202);
 }
 
-uint8_t ESP8266AVRISPWebServer::write_flash_pages(int length) {
-    int x = 0;
-    int page = addr_page(here);
-    while (x < length) {
-        yield();
-        if (page != addr_page(here)) {
-            commit(page);
-            page = addr_page(here);
-        }
-        flash(LOW, here, buff[x++]);
-        flash(HIGH, here, buff[x++]);
-        here++;
-    }
-    commit(page);
-    return Resp_STK_OK;
+// write the next pages of the /program job, for at most AVRISP_JOB_SLICE ms.
+// while the target is busy with a page the server gets the CPU back
+void ESP8266AVRISPWebServer::runJob()
+{
+	if (_jobState != AVRISP_JOB_RUNNING) {
+		return;
+	}
+	uint16_t pagesize = _jobImage.manifest().pagesize;
+	uint32_t started = millis();
+	do {
+		if (!_engine.ready()) {
+			// erase or page write still running, come back next time
+			return;
+		}
+		uint32_t addr;
+		int r = _jobImage.readPage(addr, _arena.page());
+		if (r < 0) {
+			finishJob(AVRISP_JOB_FAILED, "read error");
+			return;
+		}
+		if (r == 0) {
+			finishJob(AVRISP_JOB_DONE, nullptr);
+			return;
+		}
+		if (_engine.writeFlash(addr, pagesize) != Resp_STK_OK) {
+			finishJob(AVRISP_JOB_FAILED, "page needs chip erase");
+			return;
+		}
+		_jobSession.bytes += pagesize;
+		_jobDone++;
+	} while (millis() - started < AVRISP_JOB_SLICE);
 }
 
-uint8_t ESP8266AVRISPWebServer::write_eeprom(int length) {
-    // here is a word address, get the byte address
-    int start = here * 2;
-    int remaining = length;
-    if (length > param.eepromsize) {
-        error++;
-        return Resp_STK_FAILED;
-    }
-    while (remaining > EECHUNK) {
-        write_eeprom_chunk(start, EECHUNK);
-        start += EECHUNK;
-        remaining -= EECHUNK;
-    }
-    write_eeprom_chunk(start, remaining);
-    return Resp_STK_OK;
-}
-// write (length) bytes, (start) is a byte address
-uint8_t ESP8266AVRISPWebServer::write_eeprom_chunk(int start, int length) {
-    // this writes byte-by-byte,
-    // page writing may be faster (4 bytes at a time)
-    fill(length);
-    // prog_lamp(LOW);
-    for (int x = 0; x < length; x++) {
-        int addr = start + x;
-        spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, buff[x]);
-        delay(45);
-    }
-    // prog_lamp(HIGH);
-    return Resp_STK_OK;
-}
-
-void ESP8266AVRISPWebServer::program_page() {
-    char result = (char) Resp_STK_FAILED;
-    int length = 256 * getch();
-    length += getch();
-    char memtype = getch();
-    char buf[100];
-    // flash memory @here, (length) bytes
-    if (memtype == 'F') {
-        write_flash(length);
-        return;
-    }
-
-	uint8_t resp[2];
-    if (memtype == 'E') {
-        result = (char)write_eeprom(length);
-        if (Sync_CRC_EOP == getch()) {
-            //_client.print((char) Resp_STK_INSYNC);
-            //_client.print(result);
-			resp[0] = Resp_STK_INSYNC;
-			resp[1] = result;
-			send_P(200, "text/plain", (const char *)resp, 2);
-        } else {
-            error++;
-            //_client.print((char) Resp_STK_NOSYNC);
-			resp[0] = Resp_STK_NOSYNC;
-			send_P(200, "text/plain", (const char *)resp, 1);
-        }
-        return;
-    }
-    //_client.print((char)Resp_STK_FAILED);
-	resp[0] = Resp_STK_NOSYNC;
-	send_P(200, "text/plain", (const char *)resp, 1);
-	return;
-
+void ESP8266AVRISPWebServer::finishJob(AVRISPJobState_t state, const char* err)
+{
+	_jobResult = finishSession(_jobSession, err);
+	_jobImage.close();
+	_jobState = state;
 }
 
-uint8_t ESP8266AVRISPWebServer::flash_read(uint8_t hilo, int addr) {
-    return spi_transaction(0x20 + hilo * 8,
-                           (addr >> 8) & 0xFF,
-                           addr & 0xFF,
-                           0);
+// the /program job: {"state":..,"image":..,"done":..,"pages":..}, and the
+// statistics as /flash gives them once it ended
+void ESP8266AVRISPWebServer::handleStatus(int code)
+{
+	static const char* const names[] = { "idle", "running", "done", "failed", "aborted" };
+	String json = "{\"state\":\"";
+	json += names[_jobState];
+	json += "\"";
+	if (_jobState != AVRISP_JOB_IDLE) {
+		json += ",\"image\":\"";
+		json += _jobName;
+		json += "\",\"done\":";
+		json += _jobDone;
+		if (_jobState == AVRISP_JOB_RUNNING) {
+			json += ",\"pages\":";
+			json += _jobImage.manifest().pages;
+		} else {
+			json += ",\"result\":";
+			json += _jobResult;
+		}
+	}
+	json += "}";
+	sendReply(code, "application/json", (const uint8_t *)json.c_str(), json.length());
 }
 
-void ESP8266AVRISPWebServer::flash_read_page(int length, uint8_t* data) {
-    //uint8_t *data = (uint8_t *) malloc(length + 1);
-    for (int x = 0; x < length; x += 2) {
-        *(data + x) = flash_read(LOW, here);
-        *(data + x + 1) = flash_read(HIGH, here);
-        here++;
-    }
-    *(data + length) = Resp_STK_OK;
-    //_client.write((const uint8_t *)data, (size_t)(length + 1));
-    //free(data);
-    return;
+// stop the /program job after the page being written, the target is left
+// partly programmed
+void ESP8266AVRISPWebServer::handleAbort()
+{
+	if (_jobState != AVRISP_JOB_RUNNING) {
+		send(409, "text/plain", "no job");
+		return;
+	}
+	finishJob(AVRISP_JOB_ABORTED, "aborted");
+	handleStatus(200);
 }
 
-void ESP8266AVRISPWebServer::eeprom_read_page(int length) {
-    // here again we have a word address
-    uint8_t *data = (uint8_t *) malloc(length + 1);
-    int start = here * 2;
-    for (int x = 0; x < length; x++) {
-        int addr = start + x;
-        uint8_t ee = spi_transaction(0xA0, (addr >> 8) & 0xFF, addr & 0xFF, 0xFF);
-        *(data + x) = ee;
-    }
-    *(data + length) = Resp_STK_OK;
-    _client.write((const uint8_t *)data, (size_t)(length + 1));
-    free(data);
-    return;
+// {"count":..,"avg":..,"max":..,"log2":[..]}, log2[n] counts 2^n to 2^(n+1)-1 us,
+// trailing empty buckets left out
+static void histogramJson(String& json, const AVRISPHistogram& h)
+{
+	json += "{\"count\":";
+	json += h.count();
+	json += ",\"avg\":";
+	json += h.average();
+	json += ",\"max\":";
+	json += h.max();
+	json += ",\"log2\":[";
+	int used = AVRISP_HIST_BUCKETS;
+	while (used > 0 && !h.bucket(used - 1)) {
+		used--;
+	}
+	for (int i = 0; i < used; i++) {
+		if (i) {
+			json += ',';
+		}
+		json += h.bucket(i);
+	}
+	json += "]}";
 }
 
-void ESP8266AVRISPWebServer::read_page() {
-    char result = (char)Resp_STK_FAILED;
-    int length = 256 * getch();
-    length += getch();
-    char memtype = getch();
-	uint8_t *data = (uint8_t *) malloc(length + 2);
-    if (Sync_CRC_EOP != getch()) {
-        error++;
-        //_client.print((char) Resp_STK_NOSYNC);
-		*data = Resp_STK_NOSYNC;
-		send_P(200, "text/plain", (const char *)data, 1);
-		free(data);
-        return;
-    }
-    //_client.print((char) Resp_STK_INSYNC);
-	*data = Resp_STK_INSYNC;
-    if (memtype == 'F'){
-		flash_read_page(length,data+1);
-		send_P(200, "text/plain", (const char *)data, length + 2);
-	}
-    if (memtype == 'E') eeprom_read_page(length);
-	free(data);
-    return;
+// counters since start up or DELETE /stats: STK500 commands by command byte,
+// bytes, the last /flash or /program session, the /program job, engine errors,
+// heap and timing histograms in us of each phase
+void ESP8266AVRISPWebServer::handleStats()
+{
+	const AVRISP_stats_t& st = _engine.stats();
+	String json = "{\"uptime_ms\":";
+	json += millis();
+	json += ",\"commands\":{";
+	bool first = true;
+	for (int i = 0; i < AVRISP_STK_COMMANDS; i++) {
+		if (!st.commands[i]) {
+			continue;
+		}
+		char key[8];
+		snprintf(key, sizeof(key), "\"%02x\":", AVRISP_STK_FIRST + i);
+		if (!first) {
+			json += ',';
+		}
+		first = false;
+		json += key;
+		json += st.commands[i];
+	}
+	json += "},\"unknown_commands\":";
+	json += st.unknown;
+	json += ",\"errors\":";
+	json += _engine.errors();
+	json += ",\"overflows\":";
+	json += _arena.overflows();
+	json += ",\"bytes\":{\"flash\":";
+	json += st.flashBytes;
+	json += ",\"eeprom\":";
+	json += st.eepromBytes;
+	json += ",\"verified\":";
+	json += st.verifiedBytes;
+	json += "},\"last\":{\"bytes\":";
+	json += _last.bytes;
+	json += ",\"ms\":";
+	json += _last.ms;
+	json += ",\"bps\":";
+	json += _last.bps;
+	json += "}";
+	if (_jobState == AVRISP_JOB_RUNNING) {
+		json += ",\"job\":{\"page\":";
+		json += _jobDone;
+		json += ",\"pages\":";
+		json += _jobImage.manifest().pages;
+		json += "}";
+	}
+	json += ",\"sck\":";
+	json += _engine.sckFrequency();
+	json += ",\"heap\":{\"free\":";
+	json += ESP.getFreeHeap();
+	json += ",\"max_block\":";
+	json += ESP.getMaxFreeBlockSize();
+	json += ",\"fragmentation\":";
+	json += ESP.getHeapFragmentation();
+	json += "},\"us\":{\"parse\":";
+	histogramJson(json, _parseTime);
+	json += ",\"command\":";
+	histogramJson(json, st.command);
+	json += ",\"spi\":";
+	histogramJson(json, st.spi);
+	json += ",\"wait\":";
+	histogramJson(json, st.wait);
+	json += ",\"send\":";
+	histogramJson(json, _sendTime);
+	json += "}}";
+	sendReply(200, "application/json", (const uint8_t *)json.c_str(), json.length());
 }
 
-void ESP8266AVRISPWebServer::read_signature() {
-	uint8_t resp[5];
-    if (Sync_CRC_EOP != getch()) {
-        error++;
-        //_client.print((char) Resp_STK_NOSYNC);
-		resp[0] = Resp_STK_NOSYNC;
-		send_P(200, "text/plain", (const char *)resp, 1);
-        return;
-    }
-    //_client.print((char) Resp_STK_INSYNC);
-    uint8_t high = spi_transaction(0x30, 0x00, 0x00, 0x00);
-    //_client.print((char) high);
-    uint8_t middle = spi_transaction(0x30, 0x00, 0x01, 0x00);
-    //_client.print((char) middle);
-    uint8_t low = spi_transaction(0x30, 0x00, 0x02, 0x00);
-    //_client.print((char) low);
-    //_client.print((char) Resp_STK_OK);
-	resp[0] = Resp_STK_INSYNC;
-	resp[1] = high;
-	resp[2] = middle;
-	resp[3] = low;
-	resp[4] = Resp_STK_OK;
-	send_P(200, "text/plain", (const char*)resp, 5);
-	Serial.print("read_signature: ");
-	Serial.println((const char*)resp);
-}
-
-// It seems ArduinoISP is based on the original STK500 (not v2)
-// but implements only a subset of the commands.
-int ESP8266AVRISPWebServer::avrisp() {
-#ifdef HTTP_ESPAVRISP_DEBUG
-	Serial.print("_currentBodyIndex: ");
-	Serial.println(_currentBodyIndex);
-#endif
-    uint8_t data, low, high;
-    uint8_t ch = getch();
-	char resp[9];
-#ifdef HTTP_ESPAVRISP_DEBUG
-    std::map<uint8_t,char*>::iterator it = cmd_debug.find(ch);
-    if (it != cmd_debug.end()){
-    	Serial.print("Command: ");
-		Serial.println(cmd_debug[ch]);
-    }
-#endif
-    // AVRISP_DEBUG("CMD 0x%02x", ch);
-    switch (ch) {
-    case Cmnd_STK_GET_SYNC:
-        error = 0;
-        empty_reply();
-        break;
+void ESP8266AVRISPWebServer::clearStats()
+{
+	_engine.clearStats();
+	_parseTime.clear();
+	_sendTime.clear();
+	memset(&_last, 0, sizeof(_last));
+}
 
-    case Cmnd_STK_GET_SIGN_ON:
-        if (getch() == Sync_CRC_EOP) {
-            //_client.print((char) Resp_STK_INSYNC);
-            //_client.print(F("AVR ISP")); // AVR061 says "AVR STK"?
-            //_client.print((char) Resp_STK_OK);
-			resp[0] = Resp_STK_INSYNC;
-			resp[1] = 'A';
-			resp[2] = 'V';
-			resp[3] = 'R';
-			resp[4] = ' ';
-			resp[5] = 'I';
-			resp[6] = 'S';
-			resp[7] = 'P';
-			resp[8] = Resp_STK_INSYNC;
-			send_P(200, "text/plain", resp, 9);
-        }
-        break;
+// the /program job owns the target and the page buffer, answer 409
+bool ESP8266AVRISPWebServer::rejectBusy()
+{
+	if (_jobState != AVRISP_JOB_RUNNING) {
+		return false;
+	}
+	sendReply(409, "text/plain", (const uint8_t *)"busy", 4);
+	return true;
+}
 
-    case Cmnd_STK_GET_PARAMETER:
-        get_parameter(getch());
-        break;
+// a binary body starting at an addr that is not a multiple of align (bytes)
+// would be shifted by writeFlash(), which takes words. answer 400
+bool ESP8266AVRISPWebServer::rejectAddr(int align)
+{
+	if (!hasArg("addr") || arg("addr").toInt() % align == 0) {
+		return false;
+	}
+	send(400, "text/plain", "bad addr");
+	return true;
+}
 
-    case Cmnd_STK_SET_DEVICE:
-        fill(20);
-        set_parameters();
-        empty_reply();
-        break;
+// Intel HEX record at p, returns the end of it
+static char* hexRecord(char* p, uint8_t type, uint16_t addr, const uint8_t* data, uint8_t len)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	uint8_t head[4] = { len, (uint8_t)(addr >> 8), (uint8_t)addr, type };
+	uint8_t sum = 0;
+	*p++ = ':';
+	for (int i = 0; i < 4 + len; i++) {
+		uint8_t b = i < 4 ? head[i] : data[i - 4];
+		*p++ = digits[b >> 4];
+		*p++ = digits[b & 0x0F];
+		sum += b;
+	}
+	sum = -sum;
+	*p++ = digits[sum >> 4];
+	*p++ = digits[sum & 0x0F];
+	*p++ = '\r';
+	*p++ = '\n';
+	return p;
+}
 
-    case Cmnd_STK_SET_DEVICE_EXT:   // ignored
-        fill(5);
-        empty_reply();
-        break;
+// stream flash or EEPROM of the target with chunked transfer encoding. the
+// body and reply buffers take turns: one is read from the target in SPI
+// bursts while the other drains into the TCP window.
+// arguments: mem (flash or eeprom), start, len (bytes, default up to the end
+// of the memory), format (bin or hex), target (of a gang)
+void ESP8266AVRISPWebServer::handleDump()
+{
+	if (rejectBusy()) {
+		return;
+	}
+	String mem = hasArg("mem") ? arg("mem") : "flash";
+	if (mem != "flash" && mem != "eeprom") {
+		send(400, "text/plain", "bad mem");
+		return;
+	}
+	uint8_t memtype = mem == "flash" ? 'F' : 'E';
+	bool hex = arg("format") == "hex";
 
-    case Cmnd_STK_ENTER_PROGMODE:
-        start_pmode();
-        empty_reply();
-        break;
+	bool ownPmode = !_engine.inProgramMode();
+	if (ownPmode) {
+		_engine.startProgramMode();
+	}
+	// sizes come from the device table or SET_DEVICE
+	AVRISP_parameter_t& param = _engine.parameters();
+	uint32_t size = memtype == 'F' ? param.flashsize : param.eepromsize;
+	uint32_t start = hasArg("start") ? strtoul(arg("start").c_str(), nullptr, 0) : 0;
+	uint32_t len = hasArg("len") ? strtoul(arg("len").c_str(), nullptr, 0) : (size > start ? size - start : 0);
+	const char* err = nullptr;
+	if (!len) {
+		err = "bad len";
+	} else if (size && start + len > size) {
+		err = "beyond the end";
+	} else if (hasArg("target") && !_engine.selectTarget(arg("target").toInt())) {
+		err = "bad target";
+	}
+	if (err) {
+		if (ownPmode) {
+			_engine.endProgramMode();
+		}
+		send(400, "text/plain", err);
+		return;
+	}
 
-    case Cmnd_STK_LOAD_ADDRESS:
-        here = getch();
-        here += 256 * getch();
-        // AVRISP_DEBUG("here=0x%04x", here);
-        empty_reply();
-        break;
+	_replyKeepAlive = _keepAlive && !_bodyOverflow && _bodyRemaining == 0 && !_bodyChunked;
+	String header = "HTTP/1.1 200 OK\r\nContent-Type: ";
+	header += hex ? "text/plain" : "application/octet-stream";
+	header += "\r\nTransfer-Encoding: chunked";
+	header += _replyKeepAlive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+	_currentClient.write((const uint8_t *)header.c_str(), header.length());
+
+	struct {
+		uint8_t* buf;
+		size_t size;
+		size_t from;            // unsent part
+		size_t to;
+	} slot[2] = {
+		{ _arena.body(), _arena.bodySize(), 0, 0 },
+		{ _arena.reply() - _arena.replyHeadroom(), _arena.replySize() + _arena.replyHeadroom(), 0, 0 }
+	};
+	uint32_t addr = start;
+	uint32_t end = start + len;
+	uint32_t segment = 0;       // 64K segment of the last type 04 record
+
+	// next chunk into slot n, framed with its size line
+	auto fill = [&](int n) {
+		// 8 bytes in front for the size line, the chunk end and the last chunk behind
+		uint8_t* data = slot[n].buf + 8;
+		size_t room = slot[n].size - 8 - 2 - 5;
+		uint8_t* p = data;
+		if (!hex) {
+			size_t count = end - addr < room ? end - addr : room;
+			_engine.readMemory(memtype, addr, count, p);
+			p += count;
+			addr += count;
+		} else {
+			// 45 characters per record of 16 bytes, one more record for an unaligned
+			// start, a type 04 and the end record
+			size_t count = (room - 17 - 13) / 45;
+			count = count > 1 ? (count - 1) * 16 : 16;
+			if (count > _arena.pageSize()) count = _arena.pageSize();
+			if (count > end - addr) count = end - addr;
+			uint8_t* raw = _arena.page();
+			_engine.readMemory(memtype, addr, count, raw);
+			for (size_t x = 0; x < count; ) {
+				uint32_t a = addr + x;
+				size_t rec = 16 - (a & 15);
+				if (rec > count - x) rec = count - x;
+				if ((a >> 16) != segment) {
+					segment = a >> 16;
+					uint8_t ext[2] = { (uint8_t)(segment >> 8), (uint8_t)segment };
+					p = (uint8_t *)hexRecord((char *)p, 4, 0, ext, 2);
+				}
+				p = (uint8_t *)hexRecord((char *)p, 0, a & 0xFFFF, raw + x, rec);
+				x += rec;
+			}
+			addr += count;
+			if (addr >= end) {
+				p = (uint8_t *)hexRecord((char *)p, 1, 0, nullptr, 0);
+			}
+		}
+		char line[8];
+		int linelen = snprintf(line, sizeof(line), "%x\r\n", (unsigned)(p - data));
+		memcpy(data - linelen, line, linelen);
+		memcpy(p, "\r\n", 2);
+		p += 2;
+		if (addr >= end) {
+			memcpy(p, "0\r\n\r\n", 5);
+			p += 5;
+		}
+		slot[n].from = 8 - linelen;
+		slot[n].to = p - slot[n].buf;
+	};
+
+	fill(0);
+	int sending = 0;
+	uint32_t waiting = millis();
+	while (slot[sending].from < slot[sending].to) {
+		int next = sending ^ 1;
+		if (slot[next].from == slot[next].to && addr < end) {
+			fill(next);
+		}
+		size_t n = _currentClient.availableForWrite();
+		if (n) {
+			if (n > slot[sending].to - slot[sending].from) {
+				n = slot[sending].to - slot[sending].from;
+			}
+			n = _currentClient.write(slot[sending].buf + slot[sending].from, n);
+		}
+		if (n) {
+			slot[sending].from += n;
+			waiting = millis();
+			if (slot[sending].from == slot[sending].to) {
+				sending = next;
+			}
+		} else if (!_currentClient.connected() || millis() - waiting > HTTP_MAX_SEND_WAIT) {
+			// the response is cut short, the client must not wait for more
+			_replyKeepAlive = false;
+			break;
+		} else {
+			yield();
+		}
+	}
+	_engine.selectTarget(0);
+	if (ownPmode) {
+		_engine.endProgramMode();
+	}
+}
 
-    // XXX: not implemented!
-    case Cmnd_STK_PROG_FLASH:
-        low = getch();
-        high = getch();
-        empty_reply();
-        break;
+// read an Intel HEX or binary body and hand it to sink page by page. returns
+// an error string or nullptr
+const char* ESP8266AVRISPWebServer::receiveImage(int pagesize, AVRISPIntelHex::THandlerFunction sink)
+{
+	uint8_t first;
+	int n = readBody(&first, 1);
+	if (n < 0) {
+		return "timeout";
+	}
+	if (n == 0) {
+		return nullptr;
+	}
+	if (first == ':') {
+		return receiveHex(first, pagesize, sink);
+	}
+	uint32_t start = hasArg("addr") ? arg("addr").toInt() : 0;
+	return receiveBinary(first, start, pagesize, sink);
+}
 
-    // XXX: not implemented!
-    case Cmnd_STK_PROG_DATA:
-        data = getch();
-        empty_reply();
-        break;
+// raw binary body, first byte already read. returns an error string or nullptr
+const char* ESP8266AVRISPWebServer::receiveBinary(uint8_t first, uint32_t start, int pagesize, AVRISPIntelHex::THandlerFunction sink)
+{
+	uint8_t* buff = _arena.page();
+	uint32_t addr = start;
+	// first page may be partial if start is not page aligned
+	int want = pagesize - (start % pagesize);
+	buff[0] = first;
+	int fillLen = 1;
+	while (true) {
+		if (fillLen == want) {
+			if (!sink(addr, buff, fillLen)) {
+				return "write failed";
+			}
+			addr += fillLen;
+			fillLen = 0;
+			want = pagesize;
+		}
+		int n = readBody(buff + fillLen, want - fillLen);
+		if (n < 0) {
+			return "timeout";
+		}
+		if (n == 0) {
+			break;
+		}
+		fillLen += n;
+	}
+	if (fillLen > 0) {
+		// pad to a whole word
+		if (fillLen & 1) {
+			buff[fillLen++] = 0xFF;
+		}
+		if (!sink(addr, buff, fillLen)) {
+			return "write failed";
+		}
+	}
+	return nullptr;
+}
 
-    case Cmnd_STK_PROG_PAGE:
-        program_page();
-        break;
+// Intel HEX body, first byte already read. the text is staged in _body, which
+// is unused during a streamed request, and decoded straight into the page buffer
+const char* ESP8266AVRISPWebServer::receiveHex(uint8_t first, int pagesize, AVRISPIntelHex::THandlerFunction sink)
+{
+	AVRISPIntelHex hex(_arena.page(), pagesize, sink);
+	uint8_t* chunk = (uint8_t*)_body;
+	int n = 1;
+	chunk[0] = first;
+	while (n > 0) {
+		if (hex.feed(chunk, n) != AVRISP_HEX_OK) {
+			break;
+		}
+		n = readBody(chunk, _arena.bodySize());
+	}
+	if (n < 0) {
+		return "timeout";
+	}
+	AVRISPHexStatus_t status = hex.finish();
+	if (status != AVRISP_HEX_OK) {
+		return AVRISPIntelHex::statusString(status);
+	}
+	return nullptr;
+}
 
-    case Cmnd_STK_READ_PAGE:
-        read_page();
-        break;
+void ESP8266AVRISPWebServer::setReset(bool rst) {
+    _engine.setReset(rst);
+}
 
-    case Cmnd_STK_UNIVERSAL:
-        universal();
-        break;
+int ESP8266AVRISPWebServer::addTarget(uint8_t reset_pin, uint8_t miso_enable_pin) {
+    return _resetPin.addTarget(reset_pin, miso_enable_pin);
+}
 
-    case Cmnd_STK_LEAVE_PROGMODE:
-        error = 0;
-        end_pmode();
-        empty_reply();
-        delay(5);
-        // if (_client && _client.connected())
-        //_client.stop();
-        // AVRISP_DEBUG("left progmode");
-		setReset(false);
-        break;
+void ESP8266AVRISPWebServer::setMisoEnable(uint8_t target, uint8_t miso_enable_pin) {
+    _resetPin.setMisoEnable(target, miso_enable_pin);
+}
 
-    case Cmnd_STK_READ_SIGN:
-        read_signature();
-        break;
-        // expecting a command, not Sync_CRC_EOP
-        // this is how we can get back in sync
-    case Sync_CRC_EOP:       // 0x20, space
-        error++;
-        //_client.print((char) Resp_STK_NOSYNC);
-		resp[0] = Resp_STK_NOSYNC;
-		send_P(200, "text/plain", (const char *)resp, 1);
-        break;
+HTTPAVRISPState_t ESP8266AVRISPWebServer::update() {
+    switch (_state) {
+        case HTTP_AVRISP_STATE_IDLE: {
+            if (_avrispServer.hasClient()) {
+                _client = _avrispServer.available();
+                _client.setNoDelay(true);
+                ip_addr_t lip;
+                lip.addr = _client.remoteIP();
+                AVRISP_DEBUG("client connect %d.%d.%d.%d:%d", IP2STR(&lip), _client.remotePort());
+                _client.setTimeout(100); // for getch()
+                _state = HTTP_AVRISP_STATE_PENDING;
+                _reject_incoming();
+            }
+            break;
+        }
+        case HTTP_AVRISP_STATE_PENDING:
+        case HTTP_AVRISP_STATE_ACTIVE: {
+            // handle disconnect
+            if (!_client.connected()) {
+                _client.stop();
+                AVRISP_DEBUG("client disconnect");
+                if (_engine.inProgramMode()) {
+                    _engine.endProgramMode();
+                }
+                _state = HTTP_AVRISP_STATE_IDLE;
+            } else {
+                _reject_incoming();
+            }
+            break;
+        }
+    }
+    return _state;
+}
 
-      // anything else we will return STK_UNKNOWN
-    default:
-        AVRISP_DEBUG("??!?");
-        error++;
-        if (Sync_CRC_EOP == getch()) {
-            //_client.print((char)Resp_STK_UNKNOWN);
-			resp[0] = Resp_STK_NOSYNC;
-			send_P(200, "text/plain", (const char *)resp, 1);
-        } else {
-            //_client.print((char)Resp_STK_NOSYNC);
-			resp[0] = Resp_STK_NOSYNC;
-			send_P(200, "text/plain", (const char *)resp, 1);
+HTTPAVRISPState_t ESP8266AVRISPWebServer::serve() {
+    switch (update()) {
+        case HTTP_AVRISP_STATE_IDLE:
+            // should not be called when idle, error?
+            break;
+        case HTTP_AVRISP_STATE_PENDING: {
+            _state = HTTP_AVRISP_STATE_ACTIVE;
+        // fallthrough
         }
-  }
-  _currentBodyIndex = 0;
+        case HTTP_AVRISP_STATE_ACTIVE: {
+            // avrdude waits for every reply, so answer command by command
+            AVRISPClientTransport in(_client, AVRISP_TCP_TIMEOUT);
+            while (_client.available()) {
+                _engine.clearReply();
+                _engine.command(in);
+                uint32_t started = micros();
+                _client.write(_engine.reply(), _engine.replyLen());
+                _sendTime.add(micros() - started);
+                _engine.finishVerify();
+            }
+            return update();
+        }
+    }
+    return _state;
+}
+
+inline void ESP8266AVRISPWebServer::_reject_incoming(void) {
+    while (_avrispServer.hasClient()) _avrispServer.available().stop();
 }
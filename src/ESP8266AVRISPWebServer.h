@@ -16,6 +16,12 @@ Original version:
 #define ESP8266AVRISPWEBSERVER_H
 
 #include <ESP8266WebServer.h>
+#include "AVRISPArena.h"
+#include "AVRISPEngine.h"
+#include "AVRISPEsp8266.h"
+#include "AVRISPWebSocket.h"
+#include "AVRISPIntelHex.h"
+#include "AVRISPImage.h"
 
 // uncomment if you use an n-mos to level-shift the reset line
 // #define AVRISP_ACTIVE_HIGH_RESET
@@ -23,6 +29,53 @@ Original version:
 // SPI clock frequency in Hz
 #define AVRISP_SPI_FREQ   300e3
 
+// largest flash page, size of the page buffer
+#define AVRISP_PAGE_SIZE 256
+
+// largest request body (several batched pages), the reply buffer has the same size
+#define AVRISP_BODY_SIZE 1024
+
+// page size used by /flash when neither the client, the device table nor
+// SET_DEVICE gave one
+#define AVRISP_DEFAULT_PAGESIZE 128
+
+// room in front of the reply buffer for the response header
+#define AVRISP_REPLY_HEADROOM 128
+
+// WebSocket port carrying STK500 frames in binary messages, 0 to disable
+#ifndef AVRISP_WS_PORT
+#define AVRISP_WS_PORT 81
+#endif
+
+// raw TCP STK500 port for avrdude -c arduino -P net:host:port, 0 to disable
+#ifndef AVRISP_TCP_PORT
+#define AVRISP_TCP_PORT 328
+#endif
+
+// time the engine waits for the next byte of a raw TCP command, in ms
+#define AVRISP_TCP_TIMEOUT 1000
+
+// idle time before a persistent connection is dropped, in ms
+#define AVRISP_KEEPALIVE_TIMEOUT 10000
+
+// longest chunk size line of a chunked body, with extensions
+#define AVRISP_CHUNK_LINE 64
+
+// requests already queued on a connection served in one handleClient2() call
+#define AVRISP_MAX_PIPELINE 8
+
+// longest a /program job works in one handleClient2() call, in ms
+#define AVRISP_JOB_SLICE 20
+
+// state of the /program job
+typedef enum {
+    AVRISP_JOB_IDLE = 0,        // none since start up
+    AVRISP_JOB_RUNNING,
+    AVRISP_JOB_DONE,
+    AVRISP_JOB_FAILED,
+    AVRISP_JOB_ABORTED
+} AVRISPJobState_t;
+
 // programmer states
 typedef enum {
     HTTP_AVRISP_STATE_IDLE = 0,    // no active TCP session
@@ -30,28 +83,29 @@ typedef enum {
     HTTP_AVRISP_STATE_ACTIVE       // programmer is active and owns the SPI bus
 } HTTPAVRISPState_t;
 
-// stk500 parameters
+// a /flash or /program request
 typedef struct {
-    uint8_t devicecode;
-    uint8_t revision;
-    uint8_t progtype;
-    uint8_t parmode;
-    uint8_t polling;
-    uint8_t selftimed;
-    uint8_t lockbytes;
-    uint8_t fusebytes;
-    int flashpoll;
-    int eeprompoll;
-    int pagesize;
-    int eepromsize;
-    int flashsize;
-} AVRISP_parameter_t;
+    bool ownPmode;              // program mode entered for the request
+    bool incremental;           // engine settings to restore
+    bool verify;
+    bool erase;                 // chip erase asked for, started by the handler
+    uint32_t started;
+    uint32_t bytes;
+    AVRISP_writetime_t writeTime;   // engine statistics at the start
+    AVRISP_pagecount_t pages;
+} AVRISPSession_t;
 
 class ESP8266AVRISPWebServer: public ESP8266WebServer
 {
 public:
-	ESP8266AVRISPWebServer(IPAddress addr, int port, uint8_t reset_pin, uint32_t spi_freq=AVRISP_SPI_FREQ, bool reset_state=false, bool reset_activehigh=false);
-	ESP8266AVRISPWebServer(int port, uint8_t reset_pin, uint32_t spi_freq=AVRISP_SPI_FREQ, bool reset_state=false, bool reset_activehigh=false);;
+	ESP8266AVRISPWebServer(IPAddress addr, int port, uint8_t reset_pin, uint32_t spi_freq=AVRISP_SPI_FREQ, bool reset_state=false, bool reset_activehigh=false, size_t body_size=AVRISP_BODY_SIZE);
+	ESP8266AVRISPWebServer(int port, uint8_t reset_pin, uint32_t spi_freq=AVRISP_SPI_FREQ, bool reset_state=false, bool reset_activehigh=false, size_t body_size=AVRISP_BODY_SIZE);
+
+    // page/body/reply buffers and their high water marks
+    const AVRISPArena& arena() const { return _arena; }
+
+    // the STK500 engine behind all transports
+    AVRISPEngine& engine() { return _engine; }
 
     // set the SPI clock frequency
     void setSpiFrequency(uint32_t);
@@ -60,6 +114,14 @@ public:
     // see AVRISP_ACTIVE_HIGH_RESET
     void setReset(bool);
 
+    // gang programming: another target on the same SPI bus with its own
+    // RESET pin, programmed together with the first one. reading back per
+    // target needs a MISO buffer per target, enabled (low) by miso_enable_pin;
+    // without them the targets are only written. returns the target index or -1
+    int addTarget(uint8_t reset_pin, uint8_t miso_enable_pin=AVRISP_NO_PIN);
+    // MISO buffer enable pin of a target, e.g. of the first one
+    void setMisoEnable(uint8_t target, uint8_t miso_enable_pin);
+
     // check for pending clients if IDLE, check for disconnect otherwise
     // returns the updated state
     HTTPAVRISPState_t update();
@@ -69,70 +131,95 @@ public:
     // returns the updated state
     HTTPAVRISPState_t serve();
 	
+	// start the HTTP server and the STK500 WebSocket and raw TCP servers
+	void begin();
+
+	// also runs a slice of the /program job
 	void handleClient2();
+
+	AVRISPJobState_t jobState() const { return _jobState; }
+
+	// reset the counters of /stats
+	void clearStats();
 	
 protected:
 
     inline void _reject_incoming(void);     // reject any incoming tcp connections
 
-    int avrisp(void);           // handle incoming STK500 commands
-
-    uint8_t getch(void);        // retrieve a character from the remote end
-    uint8_t spi_transaction(uint8_t, uint8_t, uint8_t, uint8_t);
-    void empty_reply(void);
-    void breply(uint8_t);
-
-    void get_parameter(uint8_t);
-    void set_parameters(void);
-    int addr_page(int);
-    void flash(uint8_t, int, uint8_t);
-    void write_flash(int);
-    uint8_t write_flash_pages(int length);
-    uint8_t write_eeprom(int length);
-    uint8_t write_eeprom_chunk(int start, int length);
-    void commit(int addr);
-    void program_page();
-    uint8_t flash_read(uint8_t hilo, int addr);
-    void flash_read_page(int length, uint8_t* data);
-    void eeprom_read_page(int length);
-    void read_page();
-    void read_signature();
-
-    void universal(void);
-
-    void fill(int);             // fill the buffer with n bytes
-    void start_pmode(void);     // enter program mode
-    void end_pmode(void);       // exit program mode
-
-    inline bool _resetLevel(bool reset_state) { return reset_state == _reset_activehigh; }
-	
 	void RegisterAVRISP();
+	void handleCommands();
+	void runCommands();
+	void handleWebSocket();
+	void sendReply(int code, const char* content_type, const uint8_t* data, size_t len);
+	void sendStkReply();			// send the queued STK500 replies
+	void _parseConnection(const String& value);
+	int requestPageSize(uint32_t signature = 0);
+	bool beginSession(AVRISPSession_t& session, int pagesize, bool erase);
+	void endSession(AVRISPSession_t& session, int code, const char* err);
+	void handleFlash();
+	void handleVerify();
+	void handleImageUpload();
+	void handleImageList();
+	void handleImageDelete();
+	void handleProgram();
+	void handleDump();
+	void handleStatus(int code);
+	void handleAbort();
+	void handleStats();
+	bool rejectBusy();
+	bool rejectAddr(int align);
+	void runJob();
+	void finishJob(AVRISPJobState_t state, const char* err);
+	String finishSession(AVRISPSession_t& session, const char* err);
+	const char* receiveImage(int pagesize, AVRISPIntelHex::THandlerFunction sink);
+	const char* receiveBinary(uint8_t first, uint32_t start, int pagesize, AVRISPIntelHex::THandlerFunction sink);
+	const char* receiveHex(uint8_t first, int pagesize, AVRISPIntelHex::THandlerFunction sink);
+	bool _streamedBody(const String& uri);	// body is left in the socket for the handler
+	bool _rawBody(const String& uri);		// binary body read straight into _body
+	bool _readRawBody();
+	int readBody(uint8_t* buf, size_t len);		// pull bytes of a streamed body
+	int _readChunkLine(char* line, size_t size);
 	bool _parseRequest2(WiFiClient& client);
 
-    uint32_t _spi_freq;
-    //WiFiServer _server;
-    WiFiClient _client;
-    HTTPAVRISPState_t _state;
-    uint8_t _reset_pin;
-    bool _reset_state;
-    bool _reset_activehigh;
-
-    // programmer settings, set by remote end
-    AVRISP_parameter_t param;
-    // page buffer
-    uint8_t buff[256];
+    AVRISPArena _arena;         // page, body and reply buffers
+    AVRISPEsp8266Spi _spiBus;
+    AVRISPEsp8266Reset _resetPin;
+    AVRISPEsp8266Clock _clock;
+    AVRISPEngine _engine;       // after the arena and the bindings it uses
 
-    int error = 0;
-    bool pmode = 0;
-
-    // address for reading and writing, set by 'U' command
-    int here;
-
-    //current body data index for getch() function
-    int _currentBodyIndex;
+    WiFiClient _client;         // raw TCP client
+    HTTPAVRISPState_t _state;
 	
-	char				_body[256];		//body of request
-	short				_bodyLen;		//body length
+	char*				_body;			//body of request
+	size_t				_bodyLen;		//body length
+	bool				_bodyOverflow;	//body did not fit the arena
+
+	uint32_t			_bodyRemaining;	//streamed body bytes left (Content-Length)
+	bool				_bodyChunked;	//streamed body uses chunked transfer encoding
+	uint32_t			_chunkRemaining;	//bytes left in the current chunk
+	bool				_chunkCrlf;		//a CRLF has to close the current chunk
+
+	bool				_keepAlive;		//client accepts a persistent connection
+	bool				_replyKeepAlive;	//last response kept the connection open
+	uint32_t			_requestsOnConnection;	//requests served on the current connection
+
+	AVRISPWebSocket		_ws;			//STK500 over WebSocket
+	WiFiServer			_avrispServer;	//STK500 over raw TCP, served by update()/serve()
+
+	AVRISPJobState_t	_jobState;		//background /program job
+	AVRISPImage			_jobImage;		//image it programs
+	AVRISPSession_t		_jobSession;
+	String				_jobName;
+	uint16_t			_jobDone;		//pages written so far
+	String				_jobResult;		//session statistics once it ended
+
+	AVRISPHistogram		_parseTime;		//request line, headers and buffered body, us
+	AVRISPHistogram		_sendTime;		//response writes, us
+	struct {
+		uint32_t bytes;
+		uint32_t ms;
+		uint32_t bps;
+	}					_last;			//last /flash or /program session
 };
 
 
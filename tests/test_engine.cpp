@@ -0,0 +1,259 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+AVRISPEngine against mock SPI, RESET and clock: STK500 replies, the serial
+programming instructions that reach the bus, the cost of dispatching one
+command and the command throughput of the engine itself.
+
+    AVRISP_MAX_DISPATCH_NS=2000 ctest    fail when a command costs more
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "AVRISPEngine.h"
+#include "httpcommand.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// answers like an ATmega328P that is always ready: program enable echo,
+// signature, flash reads from a word array, and records the instructions
+class MockSpi: public AVRISPSpi, public AVRISPResetPin
+{
+public:
+    MockSpi(): freq(0), index(0), rdyBsy(true), loads(0), commits(0), polls(0), others(0) {
+        memset(flash, 0xFF, sizeof(flash));
+        memset(page, 0xFF, sizeof(page));
+    }
+
+    void begin(uint32_t f) override { freq = f; index = 0; }
+    void end() override {}
+    void setFrequency(uint32_t f) override { freq = f; }
+    void setReset(bool) override { index = 0; }
+
+    uint8_t transfer(uint8_t data) override {
+        cmd[index++] = data;
+        if (index == 3) {
+            // program enable echoes its second byte
+            return cmd[0] == 0xAC ? cmd[1] : 0;
+        }
+        if (index < 4) {
+            return 0;
+        }
+        index = 0;
+        return execute();
+    }
+
+    uint8_t execute() {
+        uint32_t word = (cmd[1] << 8) | cmd[2];
+        switch (cmd[0]) {
+        case 0x30:
+            return signature[cmd[2] & 3];
+        case 0x40:
+        case 0x48:
+            page[(cmd[2] & 0x3F) * 2 + (cmd[0] == 0x48)] = cmd[3];
+            loads++;
+            return 0;
+        case 0x4C:
+            memcpy(flash + (word & ~0x3F) * 2, page, sizeof(page));
+            memset(page, 0xFF, sizeof(page));
+            commits++;
+            return 0;
+        case 0x20:
+        case 0x28:
+            return flash[word * 2 + (cmd[0] == 0x28)];
+        case 0xF0:
+            polls++;
+            // a part without RDY/BSY reads as always busy
+            return rdyBsy ? 0 : 1;
+        default:
+            others++;
+            return 0;
+        }
+    }
+
+    static const uint8_t signature[3];
+    uint32_t freq;
+    uint8_t cmd[4];
+    uint8_t index;
+    bool rdyBsy;
+    uint8_t flash[32768];
+    uint8_t page[128];
+    uint32_t loads;
+    uint32_t commits;
+    uint32_t polls;
+    uint32_t others;
+};
+
+const uint8_t MockSpi::signature[3] = { 0x1E, 0x95, 0x0F };
+
+// time only moves when the engine waits
+class MockClock: public AVRISPClock
+{
+public:
+    MockClock(): us(0) {}
+    uint32_t millis() override { return us / 1000; }
+    uint32_t micros() override { return us++; }
+    void delay(uint32_t ms) override { us += ms * 1000; }
+    void delayMicroseconds(uint32_t d) override { us += d; }
+    void yield() override {}
+    uint32_t us;
+};
+
+static std::vector<uint8_t> run(AVRISPEngine& engine, const std::vector<uint8_t>& cmd)
+{
+    AVRISPBufferTransport in(cmd.data(), cmd.size());
+    engine.clearReply();
+    engine.run(in);
+    return std::vector<uint8_t>(engine.reply(), engine.reply() + engine.replyLen());
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - since).count();
+}
+
+int main()
+{
+    AVRISPArena arena(256, 4096, 4096, 0);
+    CHECK(arena.ok());
+    MockSpi spi;
+    MockClock clock;
+    AVRISPEngine engine(spi, spi, clock, arena, 300000);
+
+    // older parts: data polling and byte wise EEPROM writes
+    AVRISP_device_t device;
+    const uint32_t old_parts[] = { 0x1e9307, 0x1e9403, 0x1e9502 };
+    for (uint32_t signature: old_parts) {
+        CHECK(AVRISPDevices::find(signature, device));
+        CHECK(!(device.flags & AVRISP_DEVICE_RDYBSY) && device.eeprompagesize == 0);
+    }
+
+    // sign on and parameters
+    std::vector<uint8_t> r = run(engine, { Cmnd_STK_GET_SYNC, Sync_CRC_EOP });
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_INSYNC, Resp_STK_OK }));
+    r = run(engine, { Cmnd_STK_GET_SIGN_ON, Sync_CRC_EOP });
+    CHECK(r.size() == 9 && r[0] == Resp_STK_INSYNC && !memcmp(&r[1], "AVR ISP", 7) && r[8] == Resp_STK_OK);
+    r = run(engine, { Cmnd_STK_GET_PARAMETER, 0x80, Sync_CRC_EOP });
+    CHECK(r.size() == 3 && r[0] == Resp_STK_INSYNC && r[2] == Resp_STK_OK);
+    r = run(engine, { 0x99, Sync_CRC_EOP });
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_UNKNOWN }));
+    r = run(engine, { Cmnd_STK_GET_SYNC, 0x00 });
+    CHECK(r.size() == 2 && r[0] == Resp_STK_NOSYNC);
+
+    // program mode picks the part from the device table
+    r = run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP });
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_INSYNC, Resp_STK_OK }));
+    CHECK(engine.inProgramMode());
+    CHECK(engine.device() != nullptr && engine.parameters().pagesize == 128);
+    // every step passes on the mock, one below the top one is used
+    CHECK(engine.sckFrequency() == 4000000 && spi.freq == 4000000);
+    r = run(engine, { Cmnd_STK_READ_SIGN, Sync_CRC_EOP });
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_INSYNC, 0x1E, 0x95, 0x0F, Resp_STK_OK }));
+
+    // a flash page: 64 word loads, one page write, then read back
+    std::vector<uint8_t> prog = { Cmnd_STK_LOAD_ADDRESS, 0x40, 0x00, Sync_CRC_EOP,
+                                  Cmnd_STK_PROG_PAGE, 0x00, 0x80, 'F' };
+    for (int i = 0; i < 128; i++) {
+        prog.push_back(i * 7);
+    }
+    prog.push_back(Sync_CRC_EOP);
+    uint32_t loads = spi.loads, commits = spi.commits;
+    r = run(engine, prog);
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_INSYNC, Resp_STK_OK, Resp_STK_INSYNC, Resp_STK_OK }));
+    CHECK(engine.ready());
+    CHECK(spi.loads - loads == 128 && spi.commits - commits == 1);
+    for (int i = 0; i < 128; i++) {
+        CHECK(spi.flash[128 + i] == (uint8_t)(i * 7));
+    }
+    r = run(engine, { Cmnd_STK_LOAD_ADDRESS, 0x40, 0x00, Sync_CRC_EOP,
+                      Cmnd_STK_READ_PAGE, 0x00, 0x80, 'F', Sync_CRC_EOP });
+    CHECK(r.size() == 2 + 130 && r[2] == Resp_STK_INSYNC && r.back() == Resp_STK_OK
+          && !memcmp(&r[3], spi.flash + 128, 128));
+
+    // a page too long for the page buffer is dropped, not overrun
+    std::vector<uint8_t> big = { Cmnd_STK_PROG_PAGE, 0x02, 0x00, 'F' };
+    big.resize(big.size() + 512, 0x55);
+    big.push_back(Sync_CRC_EOP);
+    commits = spi.commits;
+    r = run(engine, big);
+    CHECK(spi.commits == commits && arena.overflows() == 1);
+
+    // RDY/BSY that never reports ready falls back to data polling for the
+    // rest of the session only
+    spi.rdyBsy = false;
+    r = run(engine, prog);
+    // the next instruction waits the write out
+    run(engine, { Cmnd_STK_READ_SIGN, Sync_CRC_EOP });
+    CHECK(engine.pollMode() == AVRISP_POLL_DATA && engine.flashWriteTime().timeouts == 1);
+    spi.rdyBsy = true;
+
+    r = run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP });
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_INSYNC, Resp_STK_OK }));
+    CHECK(!engine.inProgramMode());
+    run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP });
+    CHECK(engine.pollMode() == AVRISP_POLL_RDYBSY);
+    run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP });
+
+    // EEPROM data longer than the part is dropped: without SET_DEVICE an
+    // unknown part has eepromsize 0, and 0x52 0x20 in the data must not
+    // run as Cmnd_STK_CHIP_ERASE
+    AVRISPEngine unknown(spi, spi, clock, arena, 300000);
+    r = run(unknown, { Cmnd_STK_PROG_PAGE, 0x00, 0x04, 'E', Cmnd_STK_CHIP_ERASE, Sync_CRC_EOP,
+                       Cmnd_STK_CHIP_ERASE, Sync_CRC_EOP, Sync_CRC_EOP,
+                       Cmnd_STK_GET_SYNC, Sync_CRC_EOP });
+    CHECK(r == std::vector<uint8_t>({ Resp_STK_INSYNC, Resp_STK_FAILED, Resp_STK_INSYNC, Resp_STK_OK }));
+    CHECK(unknown.stats().commands[Cmnd_STK_CHIP_ERASE - AVRISP_STK_FIRST] == 0);
+
+    // dispatch cost: GET_SYNC batches as a /cmd body would carry them
+    const int batch = 1000, rounds = 200;
+    std::vector<uint8_t> syncs;
+    for (int i = 0; i < batch; i++) {
+        syncs.push_back(Cmnd_STK_GET_SYNC);
+        syncs.push_back(Sync_CRC_EOP);
+    }
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        r = run(engine, syncs);
+    }
+    double dispatch = elapsed_ns(started) / (batch * rounds);
+    CHECK(r.size() == 2 * batch);
+    CHECK(engine.stats().commands[Cmnd_STK_GET_SYNC - AVRISP_STK_FIRST] >= (uint32_t)(batch * rounds));
+
+    // throughput: whole flash through PROG_PAGE with the always ready mock
+    run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP });
+    std::vector<uint8_t> image;
+    for (int p = 0; p < 256; p++) {
+        image.insert(image.end(), { Cmnd_STK_LOAD_ADDRESS, (uint8_t)(p * 64), (uint8_t)(p * 64 >> 8), Sync_CRC_EOP,
+                                    Cmnd_STK_PROG_PAGE, 0x00, 0x80, 'F' });
+        for (int i = 0; i < 128; i++) {
+            image.push_back(p + i);
+        }
+        image.push_back(Sync_CRC_EOP);
+    }
+    started = std::chrono::steady_clock::now();
+    r = run(engine, image);
+    double flash = elapsed_ns(started);
+    run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP });
+    CHECK(r.size() == 4 * 256);
+    CHECK(spi.flash[32767] == (uint8_t)(255 + 127));
+
+    printf("dispatch %.0f ns/command, PROG_PAGE %.0f KB/s\n", dispatch, 32.0 / (flash / 1e9));
+    const char* limit = getenv("AVRISP_MAX_DISPATCH_NS");
+    if (limit && dispatch > atof(limit)) {
+        printf("dispatch above %s ns\n", limit);
+        failures++;
+    }
+
+    printf("%s\n", failures ? "FAIL" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+AVRISPIntelHex on hand made records: checksums, extended segment and linear
+address records, gaps, page order, truncated files and text split at any
+point, as a streamed /flash body arrives.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "AVRISPIntelHex.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define PAGE 16
+
+// one record with its checksum
+static std::string record(uint8_t type, uint16_t addr, const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> bytes = { (uint8_t)data.size(), (uint8_t)(addr >> 8), (uint8_t)addr, type };
+    bytes.insert(bytes.end(), data.begin(), data.end());
+    uint8_t sum = 0;
+    for (uint8_t b: bytes) {
+        sum += b;
+    }
+    bytes.push_back(-sum);
+    std::string text = ":";
+    char hex[3];
+    for (uint8_t b: bytes) {
+        snprintf(hex, sizeof(hex), "%02X", b);
+        text += hex;
+    }
+    return text + "\r\n";
+}
+
+static const std::string eof = ":00000001FF\r\n";
+
+// pages handed out by the decoder
+struct Page {
+    uint32_t addr;
+    std::vector<uint8_t> data;
+};
+
+// decode text fed in chunks of step bytes (0 for all at once)
+static AVRISPHexStatus_t decode(const std::string& text, std::vector<Page>& pages, size_t step = 0)
+{
+    uint8_t buf[PAGE];
+    pages.clear();
+    AVRISPIntelHex hex(buf, sizeof(buf), [&](uint32_t addr, const uint8_t* data, size_t len) {
+        pages.push_back({ addr, std::vector<uint8_t>(data, data + len) });
+        return true;
+    });
+    const uint8_t* p = (const uint8_t*)text.data();
+    size_t n = step ? step : text.size();
+    for (size_t x = 0; x < text.size(); x += n) {
+        AVRISPHexStatus_t status = hex.feed(p + x, text.size() - x < n ? text.size() - x : n);
+        if (status != AVRISP_HEX_OK) {
+            return status;
+        }
+    }
+    return hex.finish();
+}
+
+int main()
+{
+    std::vector<Page> pages;
+
+    // a good file, then the same with one checksum digit changed
+    std::string good = record(0x00, 0x0000, { 1, 2, 3, 4 }) + eof;
+    CHECK(decode(good, pages) == AVRISP_HEX_OK);
+    CHECK(pages.size() == 1 && pages[0].addr == 0 && pages[0].data == std::vector<uint8_t>({ 1, 2, 3, 4 }));
+    std::string bad = good;
+    bad[bad.find('\r') - 1] ^= 1;
+    CHECK(decode(bad, pages) == AVRISP_HEX_BAD_CHECKSUM);
+    CHECK(decode(":0400000001020304F1\r\n" + eof, pages) == AVRISP_HEX_BAD_CHECKSUM);
+    CHECK(decode(":04000000010203G4F2\r\n" + eof, pages) == AVRISP_HEX_BAD_CHAR);
+
+    // type 02: segment 0x1000 is byte address 0x10000, type 04: 0x0002 is 0x20000
+    std::string ext = record(0x00, 0x0010, { 0xA0, 0xA1 })
+                    + record(0x02, 0x0000, { 0x10, 0x00 })
+                    + record(0x00, 0x0020, { 0xB0, 0xB1 })
+                    + record(0x04, 0x0000, { 0x00, 0x02 })
+                    + record(0x00, 0x0030, { 0xC0, 0xC1 })
+                    + eof;
+    CHECK(decode(ext, pages) == AVRISP_HEX_OK);
+    CHECK(pages.size() == 3);
+    if (pages.size() == 3) {
+        CHECK(pages[0].addr == 0x00010 && pages[0].data == std::vector<uint8_t>({ 0xA0, 0xA1 }));
+        CHECK(pages[1].addr == 0x10020 && pages[1].data == std::vector<uint8_t>({ 0xB0, 0xB1 }));
+        CHECK(pages[2].addr == 0x20030 && pages[2].data == std::vector<uint8_t>({ 0xC0, 0xC1 }));
+    }
+    CHECK(decode(record(0x04, 0x0000, { 0x02 }) + eof, pages) == AVRISP_HEX_BAD_RECORD);
+    CHECK(decode(record(0x07, 0x0000, {}) + eof, pages) == AVRISP_HEX_BAD_RECORD);
+
+    // gaps inside a page read as 0xFF, an odd end is padded to a whole word
+    std::string gaps = record(0x00, 0x0002, { 1, 2 })
+                     + record(0x00, 0x0008, { 3, 4, 5 })
+                     + eof;
+    CHECK(decode(gaps, pages) == AVRISP_HEX_OK);
+    CHECK(pages.size() == 1);
+    if (pages.size() == 1) {
+        CHECK(pages[0].addr == 0
+              && pages[0].data == std::vector<uint8_t>({ 0xFF, 0xFF, 1, 2, 0xFF, 0xFF, 0xFF, 0xFF, 3, 4, 5, 0xFF }));
+    }
+
+    // a record for a page already handed out, it would be written twice
+    std::string order = record(0x00, 0x0020, { 1, 2 })
+                      + record(0x00, 0x0000, { 3, 4 })
+                      + eof;
+    CHECK(decode(order, pages) == AVRISP_HEX_BAD_ORDER);
+    // out of order within the page being collected is fine
+    std::string within = record(0x00, 0x0004, { 1, 2 })
+                       + record(0x00, 0x0000, { 3, 4 })
+                       + eof;
+    CHECK(decode(within, pages) == AVRISP_HEX_OK);
+    CHECK(decode(good + record(0x00, 0x0040, { 1, 2 }), pages) == AVRISP_HEX_AFTER_EOF);
+
+    // no end of file record, or a record cut off
+    std::string truncated = record(0x00, 0x0000, { 1, 2, 3, 4 });
+    CHECK(decode(truncated, pages) == AVRISP_HEX_TRUNCATED);
+    CHECK(decode(good.substr(0, good.size() - 6), pages) == AVRISP_HEX_TRUNCATED);
+
+    // a longer file split at every possible point gives the same pages
+    std::string file;
+    for (int a = 0; a < 0x80; a += 8) {
+        std::vector<uint8_t> data;
+        for (int i = 0; i < 8; i++) {
+            data.push_back(a + i);
+        }
+        file += record(0x00, a, data);
+    }
+    file += record(0x04, 0x0000, { 0x00, 0x01 }) + record(0x00, 0x0000, { 0x55, 0xAA }) + eof;
+    std::vector<Page> whole;
+    CHECK(decode(file, whole) == AVRISP_HEX_OK);
+    CHECK(whole.size() == 0x80 / PAGE + 1);
+    for (size_t step = 1; step <= 23; step++) {
+        CHECK(decode(file, pages, step) == AVRISP_HEX_OK);
+        bool same = pages.size() == whole.size();
+        for (size_t i = 0; same && i < pages.size(); i++) {
+            same = pages[i].addr == whole[i].addr && pages[i].data == whole[i].data;
+        }
+        CHECK(same);
+    }
+
+    printf("%s\n", failures ? "FAIL" : "ok");
+    return failures ? 1 : 0;
+}
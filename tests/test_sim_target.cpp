@@ -0,0 +1,374 @@
+/*
+AVR ISP Programming over HTTP for ESP8266
+Copyright (c) Long Pham <it.farmer.vn@gmail.com>
+
+End-to-end flashes through AVRISPEngine into AVRISPSimTarget: the example
+sketch into an ATmega328P with erase and verify, incremental pages without
+erase, a gang of three with buffered and shared MISO, EEPROM in page mode,
+and ATmega2560 pages on both sides of the 64K word boundary. Every run checks
+the target memories, that no instruction reached a busy or confused target,
+and prints the time it would take on the wire.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "AVRISPEngine.h"
+#include "AVRISPIntelHex.h"
+#include "AVRISPSimTarget.h"
+#include "httpcommand.h"
+
+#ifndef AVRISP_TEST_HEX
+#define AVRISP_TEST_HEX "examples/HTTP_ESPAVRISP/BlinkWithoutDelay.ino.hex"
+#endif
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static std::vector<uint8_t> run(AVRISPEngine& engine, const std::vector<uint8_t>& cmd)
+{
+    AVRISPBufferTransport in(cmd.data(), cmd.size());
+    engine.clearReply();
+    engine.run(in);
+    return std::vector<uint8_t>(engine.reply(), engine.reply() + engine.replyLen());
+}
+
+static const std::vector<uint8_t> ok = { Resp_STK_INSYNC, Resp_STK_OK };
+
+// LOAD_ADDRESS and PROG_PAGE of len bytes at a byte address, as avrdude sends them
+static std::vector<uint8_t> prog_page(uint32_t addr, char memtype, const uint8_t* data, int len)
+{
+    uint32_t word = addr / 2;
+    std::vector<uint8_t> c = { Cmnd_STK_LOAD_ADDRESS, (uint8_t)word, (uint8_t)(word >> 8), Sync_CRC_EOP,
+                               Cmnd_STK_PROG_PAGE, (uint8_t)(len >> 8), (uint8_t)len, (uint8_t)memtype };
+    c.insert(c.end(), data, data + len);
+    c.push_back(Sync_CRC_EOP);
+    return c;
+}
+
+// the example sketch, avrdude style with Cmnd_STK_CHIP_ERASE and verify on
+static void flash_328p()
+{
+    std::ifstream file(AVRISP_TEST_HEX);
+    std::stringstream text;
+    text << file.rdbuf();
+    std::string hex = text.str();
+    CHECK(!hex.empty());
+
+    std::vector<uint8_t> image(32768, 0xFF);
+    uint32_t end = 0;
+    uint8_t page[128];
+    AVRISPIntelHex decoder(page, sizeof(page), [&](uint32_t addr, const uint8_t* data, size_t len) {
+        memcpy(&image[addr], data, len);
+        end = addr + len > end ? addr + len : end;
+        return true;
+    });
+    CHECK(decoder.feed((const uint8_t*)hex.data(), hex.size()) == AVRISP_HEX_OK);
+    CHECK(decoder.finish() == AVRISP_HEX_OK);
+    CHECK(end > 0);
+
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+    AVRISPSimTarget target(clock, 32768, 128, 1024, signature);
+    target.setMaxFrequency(4000000);
+    AVRISPEngine engine(target, target, clock, arena, 300000);
+
+    CHECK(run(engine, { Cmnd_STK_GET_SYNC, Sync_CRC_EOP }) == ok);
+    CHECK(run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP }) == ok);
+    CHECK(engine.device() != nullptr && engine.sckFrequency() > 300000);
+    std::vector<uint8_t> r = run(engine, { Cmnd_STK_READ_SIGN, Sync_CRC_EOP });
+    CHECK(r.size() == 5 && !memcmp(&r[1], signature, 3));
+    CHECK(run(engine, { Cmnd_STK_CHIP_ERASE, Sync_CRC_EOP }) == ok);
+    engine.setVerify(true);
+
+    uint64_t started = clock.nanos();
+    for (uint32_t a = 0; a < end; a += 128) {
+        r = run(engine, prog_page(a, 'F', &image[a], 128));
+        CHECK(r.size() == 4 && r[3] == Resp_STK_OK);
+    }
+    engine.finishVerify();
+    uint64_t elapsed = clock.nanos() - started;
+    const AVRISP_verify_t& v = engine.verifyResult();
+    CHECK(v.pages == (end + 127) / 128 && v.failed == 0 && v.crc32 == v.expected);
+    CHECK(run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP }) == ok);
+
+    CHECK(!memcmp(target.flash(), image.data(), image.size()));
+    CHECK(target.erases() == 1);
+    CHECK(target.busyViolations() == 0 && target.rejected() == 0);
+    printf("328p: %u bytes, %u pages in %.1f ms at %u Hz, %.1f us/page write cycle\n",
+           (unsigned)end, (unsigned)target.flashPages(), elapsed / 1e6, (unsigned)engine.sckFrequency(),
+           (double)engine.flashWriteTime().total_us / engine.flashWriteTime().count);
+}
+
+// avrdude's chip erase: universal 0xAC80, then program mode entered again
+// without leaving it. the erase has to finish before RESET is pulsed, and
+// blank pages are skipped afterwards
+static void avrdude_erase()
+{
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+    AVRISPSimTarget target(clock, 32768, 128, 1024, signature);
+    AVRISPEngine engine(target, target, clock, arena, 1000000);
+
+    memset(target.flash(), 0x00, target.flashSize());
+    CHECK(run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP }) == ok);
+    std::vector<uint8_t> r = run(engine, { Cmnd_STK_UNIVERSAL, 0xAC, 0x80, 0x00, 0x00, Sync_CRC_EOP });
+    CHECK(r.size() == 3 && r[2] == Resp_STK_OK);
+    CHECK(run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP }) == ok);
+    CHECK(engine.erased());
+
+    uint8_t blank[128];
+    memset(blank, 0xFF, sizeof(blank));
+    r = run(engine, prog_page(0, 'F', blank, sizeof(blank)));
+    CHECK(r.size() == 4 && r[3] == Resp_STK_OK);
+    CHECK(engine.pageCount().blank == 1 && engine.pageCount().written == 0);
+    CHECK(run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP }) == ok);
+
+    CHECK(target.erases() == 1 && target.flash()[0] == 0xFF && target.flash()[32767] == 0xFF);
+    CHECK(target.busyViolations() == 0 && target.rejected() == 0);
+}
+
+// writeFlash() driven by ready() like the /program job, with verify on. the
+// caller only comes back when the last write is over, so the engine itself
+// never has to wait for one
+static void ready_loop_verify()
+{
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+    AVRISPSimTarget target(clock, 32768, 128, 1024, signature);
+    target.setMaxFrequency(4000000);
+    AVRISPEngine engine(target, target, clock, arena, 300000);
+
+    engine.startProgramMode();
+    engine.chipErase();
+    engine.setVerify(true);
+    engine.clearStats();
+    uint64_t blocked = 0;
+    for (int p = 0; p < 16; p++) {
+        while (!engine.ready()) {
+            clock.advanceNs(500000);
+        }
+        memset(arena.page(), p, 128);
+        uint64_t started = clock.nanos();
+        engine.writeFlash(p * 128, 128);
+        blocked += clock.nanos() - started;
+    }
+    while (!engine.ready()) {
+        clock.advanceNs(500000);
+    }
+    engine.finishVerify();
+    engine.endProgramMode();
+
+    CHECK(engine.verifyResult().pages == 16 && engine.verifyResult().failed == 0);
+    CHECK(engine.stats().wait.max() < 1000);
+    CHECK(target.busyViolations() == 0);
+    printf("ready loop: 16 pages with verify, %.1f ms in writeFlash\n", blocked / 1e6);
+}
+
+// incremental without a chip erase: a page the target holds is skipped, one
+// that only clears bits is written, one that needs a bit set fails and is
+// left as it was instead of being ANDed into the old contents
+static void incremental_pages()
+{
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+    AVRISPSimTarget target(clock, 32768, 128, 1024, signature);
+    AVRISPEngine engine(target, target, clock, arena, 1000000);
+
+    uint8_t held[128], cleared[128], set[128];
+    for (int i = 0; i < 128; i++) {
+        held[i] = i;
+        cleared[i] = i & 0xF0;
+        set[i] = 0x55;
+    }
+    memcpy(target.flash(), held, 128);
+    memcpy(target.flash() + 128, held, 128);
+    memset(target.flash() + 256, 0x00, 128);
+    CHECK(run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP }) == ok);
+    engine.setIncremental(true);
+
+    std::vector<uint8_t> r = run(engine, prog_page(0, 'F', held, 128));
+    CHECK(r.size() == 4 && r[3] == Resp_STK_OK);
+    r = run(engine, prog_page(128, 'F', cleared, 128));
+    CHECK(r.size() == 4 && r[3] == Resp_STK_OK);
+    r = run(engine, prog_page(256, 'F', set, 128));
+    CHECK(r.size() == 4 && r[3] == Resp_STK_FAILED);
+    CHECK(run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP }) == ok);
+
+    const AVRISP_pagecount_t& pages = engine.pageCount();
+    CHECK(pages.unchanged == 1 && pages.written == 1 && pages.needs_erase == 1);
+    CHECK(target.flashPages() == 1);
+    CHECK(!memcmp(target.flash(), held, 128));
+    CHECK(!memcmp(target.flash() + 128, cleared, 128));
+    CHECK(target.flash()[256] == 0x00 && target.flash()[383] == 0x00);
+    CHECK(target.busyViolations() == 0 && target.rejected() == 0);
+}
+
+// three ATmega328P on one bus, written together by writeFlash() with verify
+// and data polling. the second target has a page that did not erase, stuck
+// at 0. with MISO buffered per target each one is polled and read back and
+// the stuck page shows in failed_targets. with MISO shared the engine can
+// not select a target: it waits worst case delays and skips the read back
+static void gang(bool shared)
+{
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+    AVRISPSimTarget t0(clock, 32768, 128, 1024, signature);
+    AVRISPSimTarget t1(clock, 32768, 128, 1024, signature);
+    AVRISPSimTarget t2(clock, 32768, 128, 1024, signature);
+    AVRISPSimTarget* targets[] = { &t0, &t1, &t2 };
+    AVRISPSimGang gang(clock);
+    for (AVRISPSimTarget* t: targets) {
+        CHECK(gang.add(*t));
+    }
+    gang.setSharedMiso(shared);
+    AVRISPEngine engine(gang, gang, clock, arena, 1000000);
+    engine.setTargets(&gang);
+    engine.setPollMode(AVRISP_POLL_DATA);
+
+    std::vector<uint8_t> image(8 * 128);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = i * 5 + 1;
+    }
+    memset(t1.flash() + 256, 0x00, 128);
+
+    engine.startProgramMode();
+    CHECK(engine.targets() == 3);
+    engine.setVerify(true);
+    uint64_t started = clock.nanos();
+    for (uint32_t a = 0; a < image.size(); a += 128) {
+        memcpy(arena.page(), &image[a], 128);
+        CHECK(engine.writeFlash(a, 128) == Resp_STK_OK);
+    }
+    engine.finishVerify();
+    uint64_t elapsed = clock.nanos() - started;
+    const AVRISP_verify_t v = engine.verifyResult();
+    engine.endProgramMode();
+
+    // the same instructions reached every target, the writes ran together
+    for (AVRISPSimTarget* t: targets) {
+        CHECK(t->flashPages() == 8 && t->instructions() == t0.instructions());
+        CHECK(t->busyViolations() == 0 && t->rejected() == 0);
+    }
+    CHECK(!memcmp(t0.flash(), image.data(), image.size()));
+    CHECK(!memcmp(t2.flash(), image.data(), image.size()));
+    CHECK(!memcmp(t1.flash(), image.data(), 256) && t1.flash()[256] == 0x00);
+    if (shared) {
+        CHECK(v.pages == 0 && v.failed_targets == 0);
+    } else {
+        CHECK(v.pages == 8 && v.failed == 1 && v.first_bad == 256);
+        CHECK(v.failed_targets == 1UL << 1);
+    }
+    printf("gang: 3 targets, 8 pages in %.1f ms, MISO %s\n", elapsed / 1e6, shared ? "shared" : "buffered");
+}
+
+// 64 EEPROM bytes with 4 byte EEPROM pages from SET_DEVICE_EXT
+static void eeprom_pages()
+{
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x95, 0x0F };
+    AVRISPSimTarget target(clock, 32768, 128, 1024, signature);
+    AVRISPEngine engine(target, target, clock, arena, 1000000);
+
+    CHECK(run(engine, { Cmnd_STK_SET_DEVICE_EXT, 5, 4, 0xD7, 0xC2, 0, Sync_CRC_EOP }) == ok);
+    CHECK(run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP }) == ok);
+    uint8_t data[64];
+    for (int i = 0; i < 64; i++) {
+        data[i] = i * 3;
+    }
+    uint64_t started = clock.nanos();
+    std::vector<uint8_t> r = run(engine, prog_page(0x20, 'E', data, sizeof(data)));
+    uint64_t elapsed = clock.nanos() - started;
+    CHECK(r.size() == 4 && r[3] == Resp_STK_OK);
+    r = run(engine, { Cmnd_STK_LOAD_ADDRESS, 0x10, 0x00, Sync_CRC_EOP,
+                      Cmnd_STK_READ_PAGE, 0x00, 64, 'E', Sync_CRC_EOP });
+    CHECK(r.size() == 2 + 66 && !memcmp(&r[3], data, sizeof(data)));
+    CHECK(run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP }) == ok);
+
+    CHECK(!memcmp(target.eeprom() + 0x20, data, sizeof(data)));
+    // one write cycle per 4 byte page, not per byte
+    CHECK(target.eepromWrites() == 16);
+    CHECK(target.busyViolations() == 0 && target.rejected() == 0);
+    printf("eeprom: 64 bytes in %u page writes, %.1f ms\n", (unsigned)target.eepromWrites(), elapsed / 1e6);
+}
+
+// 256 byte pages of an ATmega2560 around 0x20000, the first byte address
+// that needs Load Extended Address
+static void flash_2560()
+{
+    AVRISPArena arena(256, 1024, 1024, 0);
+    AVRISPSimClock clock;
+    const uint8_t signature[3] = { 0x1E, 0x98, 0x01 };
+    AVRISPSimTarget target(clock, 262144, 256, 4096, signature, 8);
+    target.setMaxFrequency(4000000);
+    AVRISPEngine engine(target, target, clock, arena, 300000);
+
+    std::vector<uint8_t> image(262144);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (i * 7 + 3) ^ (i >> 16);
+    }
+
+    // writeFlash() as /flash and /program use it
+    engine.startProgramMode();
+    CHECK(engine.device() != nullptr && engine.parameters().pagesize == 256);
+    engine.chipErase();
+    engine.setVerify(true);
+    const uint32_t pages[] = { 0x00000, 0x1FF00, 0x20000, 0x3FF00 };
+    for (uint32_t a: pages) {
+        memcpy(arena.page(), &image[a], 256);
+        engine.writeFlash(a, 256);
+    }
+    engine.finishVerify();
+    CHECK(engine.verifyResult().pages == 4 && engine.verifyResult().failed == 0);
+    for (uint32_t a: pages) {
+        CHECK(!memcmp(target.flash() + a, &image[a], 256));
+    }
+    engine.endProgramMode();
+
+    // avrdude: 0x4D through Cmnd_STK_UNIVERSAL before the load address
+    CHECK(run(engine, { Cmnd_STK_ENTER_PROGMODE, Sync_CRC_EOP }) == ok);
+    for (uint32_t a: { 0x1FE00u, 0x20200u }) {
+        uint32_t word = a / 2;
+        run(engine, { Cmnd_STK_UNIVERSAL, 0x4D, 0x00, (uint8_t)(word >> 16), 0x00, Sync_CRC_EOP });
+        std::vector<uint8_t> r = run(engine, prog_page(a, 'F', &image[a], 256));
+        CHECK(r.size() == 4 && r[3] == Resp_STK_OK);
+        run(engine, { Cmnd_STK_UNIVERSAL, 0x4D, 0x00, (uint8_t)(word >> 16), 0x00, Sync_CRC_EOP });
+        r = run(engine, { Cmnd_STK_LOAD_ADDRESS, (uint8_t)word, (uint8_t)(word >> 8), Sync_CRC_EOP,
+                          Cmnd_STK_READ_PAGE, 0x01, 0x00, 'F', Sync_CRC_EOP });
+        CHECK(r.size() == 2 + 258 && !memcmp(&r[3], &image[a], 256));
+        CHECK(!memcmp(target.flash() + a, &image[a], 256));
+    }
+    CHECK(run(engine, { Cmnd_STK_LEAVE_PROGMODE, Sync_CRC_EOP }) == ok);
+    // nothing landed in the wrong segment
+    CHECK(target.flash()[0x10000] == 0xFF && target.flash()[0x30000] == 0xFF);
+    CHECK(target.busyViolations() == 0 && target.rejected() == 0);
+    printf("2560: %u pages across the 64K word boundary\n", (unsigned)target.flashPages());
+}
+
+int main()
+{
+    flash_328p();
+    avrdude_erase();
+    ready_loop_verify();
+    incremental_pages();
+    gang(false);
+    gang(true);
+    eeprom_pages();
+    flash_2560();
+    printf("%s\n", failures ? "FAIL" : "ok");
+    return failures ? 1 : 0;
+}